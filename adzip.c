@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // For copy_file_range
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,8 +10,28 @@
 #include <ctype.h>
 #include <pwd.h>
 #include <grp.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 // Dictionary Structure for a file entity's metadata
+typedef struct
+{
+    char type;
+    long size;
+    long offset;
+    char *name;
+    uid_t owner;
+    gid_t group;
+    mode_t rights;
+    int volume; // 0 when the data is in the archive file itself, otherwise the volume file holding it
+} ArchiveEntry;
+
+// How an entry is laid out in the fixed-width metadata tables of version 1 and 2 archives
 #pragma pack(push, 1)
 typedef struct
 {
@@ -21,17 +42,132 @@ typedef struct
     uid_t owner;
     gid_t group;
     mode_t rights;
-} ArchiveEntry;
+} FixedArchiveEntry;
 
 // Header of the archive which keeps track of the metadataOffset and the number of entries
+// Legacy (version 1) archives start directly with this header and update it in place
 typedef struct
 {
     long metadataOffset;
     int numEntries;
 } ArchiveHeader;
+
+// Newer archives start with a superblock that is written once when the archive is created
+typedef struct
+{
+    char magic[8];
+    int version;
+    int headerSize;
+} ArchiveSuperblock;
+
+// One of the two header slots following the superblock. Every commit writes the slot the previous
+// commit did not use, so a torn or interrupted header write can never destroy the last good header
+typedef struct
+{
+    unsigned long generation;      // Increases by one with every commit, the newest valid slot wins
+    long metadataOffset;           // Where the metadata table of this generation starts
+    long metadataSize;             // Size in bytes of that metadata table
+    int numEntries;                // Number of entries in that metadata table
+    unsigned int metadataChecksum; // CRC-32 of the metadata table
+    long summaryOffset;            // Where the directory summaries are, 0 if the archive has none
+    int numSummaries;              // Number of directory summaries
+    unsigned int summaryChecksum;  // CRC-32 of the directory summaries
+    long volumeTableOffset;        // Where the paths of the volume files are, 0 if all data is in this file
+    long volumeTableSize;          // Size in bytes of the volume paths
+    int numVolumes;                // Number of volume files
+    unsigned int volumeTableChecksum; // CRC-32 of the volume paths
+    long summaryNamesSize;         // Size in bytes of the directory names after the summaries, 0 if there are none
+    unsigned int checksum;         // CRC-32 of all the fields above
+} ArchiveHeaderSlot;
+
+// Precomputed aggregates of a directory entry, so size questions never need to visit every entry
+typedef struct
+{
+    int entryIndex;  // Index of the 'D' entry in the metadata table
+    long totalBytes; // Bytes of all the files anywhere below the directory
+    int fileCount;   // Number of files anywhere below the directory
+    int maxDepth;    // How many levels deep the deepest entry below the directory is
+} DirectorySummary;
+
+// A checkpoint of a creation in progress. The checkpoint file next to the archive is a run of these records,
+// each followed by the entries archived since the record before it
+typedef struct
+{
+    char magic[8];                 // Always CHECKPOINT_MAGIC
+    long dataEnd;                  // Everything in the archive before this offset is done
+    int numEntries;                // Entries archived so far in total, in the order the walk came across them
+    long metadataSize;             // Size in bytes of the entries added by this record, encoded like version 3 metadata
+    unsigned int metadataChecksum; // CRC-32 of the encoded entries
+    unsigned int checksum;         // CRC-32 of all the fields above
+} CheckpointHeader;
 #pragma pack(pop)
 
+#define ARCHIVE_MAGIC "ADZIPARC"
+#define ARCHIVE_VERSION_LEGACY 1
+#define ARCHIVE_VERSION_FIXED 2
+#define ARCHIVE_VERSION 3
+
+// The superblock and both slots live in their own sectors of a 4 KiB header area in front of the data
+#define ARCHIVE_HEADER_SIZE 4096
+#define ARCHIVE_SLOT_OFFSET(generation) (512L * (1 + (long)((generation) % 2)))
+
+// Block size that reflink cloning works in, data ranges have to start on it to share blocks
+#define ARCHIVE_BLOCK_SIZE 4096
+
+// Files at least this big are extracted by cloning or copying their range within the kernel
+#define CLONE_THRESHOLD (1024 * 1024)
+
+// With --direct, files at least this big start on a block boundary and go through buffers of this size
+#define DIRECT_THRESHOLD (64 * 1024)
+#define DIRECT_BUFFER_SIZE (1024 * 1024)
+#define ALIGN_TO_BLOCK(value) (((value) + ARCHIVE_BLOCK_SIZE - 1) / ARCHIVE_BLOCK_SIZE * ARCHIVE_BLOCK_SIZE)
+
+// A creation writes a checkpoint whenever it has archived this many entries or bytes since the last one (only bytes with --durable)
+#define CHECKPOINT_MAGIC "ADZIPCKP"
+#define CHECKPOINT_ENTRIES 64
+#define CHECKPOINT_BYTES (64L * 1024 * 1024)
+
+// How many times a reader looks at the header slots again when a concurrent commit got in its way
+#define LOAD_ATTEMPTS 5
+
+// Type given to an entry whose data could not be written after all, so it gets left out of the metadata
+#define DROPPED_ENTRY '\0'
+
+// For now we will just have a cap of 1000 entries, plan to make this dynamic later
+#define MAX_ARCHIVE_ENTRIES 1000
+
+// Optional modifiers that can be given between the flag and the archive file name
+typedef struct
+{
+    int durable;      // --durable: make data and metadata durable before the header that points at them is published
+    int numVolumes;   // --volumes=N: split the data of a new archive across N volume files
+    char *volumeDirs; // --volume-dirs=DIR:DIR: directories to put those volume files in, one per volume
+    int resume;       // --resume: continue an interrupted creation from its last checkpoint
+    int direct;       // --direct: preallocated, block aligned layout written and read with O_DIRECT
+} Options;
+
+Options options = {0};
+
+// Progress of the creation running right now, which the directory walk checkpoints as it goes
+typedef struct
+{
+    char *path;        // Checkpoint file next to the archive, NULL when nothing is being checkpointed
+    int resumeCount;   // Entries restored from the checkpoint, the walk passes over them instead of archiving them again
+    int savedCount;    // Entries covered by the last checkpoint written
+    long savedDataEnd; // Data high-water mark of the last checkpoint written
+    long savedSize;    // Length of the checkpoint records written so far, the next one goes right after them
+} Checkpoint;
+
+Checkpoint checkpoint = {0};
+
+// The directory walk reports to these, they are defined along with the rest of the checkpointing
+int ResumedEntry(ArchiveEntry *entries, int *entryCount, const char *name, char type);
+void CheckpointProgress(FILE *archive, ArchiveEntry *entries, int entryCount);
+
 //================================================================ PARSING ================================================================================
+#define VALID_FLAGS "caxmpduiej"
+#define USAGE "Proper Usage: adzip {-c | -a | -x | -m | -p | -d | -u | -i | -e | -j} [--durable] [--volumes=N] [--volume-dirs=DIR:DIR...] [--resume] [--direct] <archive-file> <file/directory list>\n"
+
 // Helper function, especially for creating an archive. If a file of the same archive already exists, then it will generate a new name by appending a number to it.
 void GenerateUniqueFilename(char **archiveFile)
 {
@@ -71,27 +207,101 @@ void GenerateUniqueFilename(char **archiveFile)
 }
 
 // This function is for parsing the arguments into the corresponding variables and to account for invalid checks
-void ParseArguments(int argc, char **argv, char **flag, char **archiveFile, char **file_directory)
+void ParseArguments(int argc, char **argv, char **flag, char **archiveFile, char ***file_directories, int *numFileDirectories)
 {
-    // If the number of arguments is not the expected amount
-    if (argc != 4)
+    // Any arguments starting with "--" right after the flag are options, the rest are positional
+    int argIndex = 2;
+    while (argIndex < argc && strncmp(argv[argIndex], "--", 2) == 0)
+    {
+        if (strcmp(argv[argIndex], "--durable") == 0)
+        {
+            options.durable = 1;
+        }
+        else if (strncmp(argv[argIndex], "--volumes=", 10) == 0 && atoi(argv[argIndex] + 10) > 0)
+        {
+            options.numVolumes = atoi(argv[argIndex] + 10);
+        }
+        else if (strncmp(argv[argIndex], "--volume-dirs=", 14) == 0 && argv[argIndex][14] != '\0')
+        {
+            options.volumeDirs = argv[argIndex] + 14;
+        }
+        else if (strcmp(argv[argIndex], "--resume") == 0)
+        {
+            options.resume = 1;
+        }
+        else if (strcmp(argv[argIndex], "--direct") == 0)
+        {
+            options.direct = 1;
+        }
+        else
+        {
+            printf("Invalid option '%s'!\n", argv[argIndex]);
+            printf(USAGE);
+            exit(EXIT_FAILURE);
+        }
+        argIndex++;
+    }
+
+    // Volume directories imply the number of volumes, so the two have to agree when both are given
+    if (options.volumeDirs)
+    {
+        int numDirs = 1;
+        for (const char *c = options.volumeDirs; *c; c++)
+        {
+            if (*c == ':')
+                numDirs++;
+        }
+
+        if (options.numVolumes != 0 && options.numVolumes != numDirs)
+        {
+            printf("--volumes=%d does not match the %d directories given to --volume-dirs!\n", options.numVolumes, numDirs);
+            exit(EXIT_FAILURE);
+        }
+        options.numVolumes = numDirs;
+    }
+
+    // If the number of arguments is not the expected amount, only merging takes more than one file/directory
+    int numPaths = argc - argIndex - 1;
+    if (numPaths < 1 || (numPaths > 1 && strcmp(argv[1], "-j") != 0))
     {
         printf("Invalid number of Input Arguments!\n");
-        printf("Proper Usage: adzip {-c | -a | -x | -m | -p} <archive-file> <file/directory list>\n");
+        printf(USAGE);
         exit(EXIT_FAILURE);
     }
 
     // If the incorrect flag is used, if the correct flag is used, it will return (0):
-    if (strcmp(argv[1], "-c") != 0 && strcmp(argv[1], "-a") != 0 && strcmp(argv[1], "-x") != 0 && strcmp(argv[1], "-m") != 0 && strcmp(argv[1], "-p") != 0)
+    if (strlen(argv[1]) != 2 || argv[1][0] != '-' || strchr(VALID_FLAGS, argv[1][1]) == NULL)
     {
         printf("Invalid flag inputted!\n");
-        printf("Proper Usage: adzip {-c | -a | -x | -m | -p} <archive-file> <file/directory list>\n");
+        printf(USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    // Only a new archive can be split into volumes
+    if (options.numVolumes > 0 && strcmp(argv[1], "-c") != 0)
+    {
+        printf("Volumes can only be chosen when creating an archive!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Only a creation writing into the archive file itself is checkpointed
+    if (options.resume && (strcmp(argv[1], "-c") != 0 || options.numVolumes > 0 || options.direct))
+    {
+        printf("Only creating an archive without volumes or --direct can be resumed!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The aligned layout is only written by creating an archive without volumes, and only read back by extracting it
+    if (options.direct && ((strcmp(argv[1], "-c") != 0 && strcmp(argv[1], "-x") != 0) || options.numVolumes > 0))
+    {
+        printf("--direct can only be used when creating an archive without volumes or extracting one!\n");
         exit(EXIT_FAILURE);
     }
 
     *flag = argv[1];
-    *archiveFile = strdup(argv[2]);
-    *file_directory = argv[3];
+    *archiveFile = strdup(argv[argIndex]);
+    *file_directories = &argv[argIndex + 1];
+    *numFileDirectories = numPaths;
 
     // Ensure the archive file has the .ad extension
     const char *extension = ".ad";
@@ -113,7 +323,8 @@ void ParseArguments(int argc, char **argv, char **flag, char **archiveFile, char
     }
 
     // Passes it through to generate a unique file name in case of duplicates ONLY if it's creation of archives
-    if (strcmp(*flag, "-c") == 0)
+    // Resuming is the exception, since it means to carry on with the archive that is already there
+    if ((strcmp(*flag, "-c") == 0 && !options.resume) || strcmp(*flag, "-i") == 0 || strcmp(*flag, "-j") == 0)
     {
         GenerateUniqueFilename(archiveFile);
     }
@@ -129,82 +340,190 @@ long getFileSize(const char *filename)
     return -1;
 }
 
-// Function to write a single file's data to the archive
-void writeFileToArchive(FILE *archive, const char *filePath, const char *filePathfromRoot, ArchiveEntry *entry)
+// Function to write a single file's data to the archive. Without an archive it only records the metadata,
+// leaving the offset for whoever writes the data later on. Returns 0 if the file could not be archived
+int writeFileToArchive(FILE *archive, const char *filePath, const char *filePathfromRoot, ArchiveEntry *entry)
 {
-    // We open the file in read mode
-    FILE *file = fopen(filePath, "rb");
-    if (!file)
-    {
-        perror("Failed to open file for reading");
-        return;
-    }
-
     struct stat st;
     if (stat(filePath, &st) != 0)
     {
         perror("Failed to get file status");
-        fclose(file);
-        return;
+        return 0;
     }
 
     // We get according information of the file and the archive (where the file will be writen)
-    long size = getFileSize(filePath);
-    long offset = ftell(archive);
+    long size = st.st_size;
+    long offset = -1;
 
-    // Write file data to archive
-    char buffer[PATH_MAX];
-    size_t bytesRead;
-    while ((bytesRead = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    if (archive)
     {
-        fwrite(buffer, 1, bytesRead, archive);
+        // We open the file in read mode
+        FILE *file = fopen(filePath, "rb");
+        if (!file)
+        {
+            perror("Failed to open file for reading");
+            return 0;
+        }
+
+        offset = ftell(archive);
+
+        // Write file data to archive
+        char buffer[PATH_MAX];
+        size_t bytesRead;
+        while ((bytesRead = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        {
+            fwrite(buffer, 1, bytesRead, archive);
+        }
+        fclose(file);
+
+        // The size is whatever we actually copied, in case the file changed since we looked at it
+        size = ftell(archive) - offset;
     }
-    fclose(file);
 
     // Set up the entry for metadata
     entry->type = 'F';
     entry->size = size;
     entry->offset = offset;
-    strcpy(entry->name, filePathfromRoot);
+    entry->name = strdup(filePathfromRoot);
     entry->owner = st.st_uid;
     entry->group = st.st_gid;
     entry->rights = st.st_mode;
+    entry->volume = 0;
+    return 1;
 }
 
-// Recursive function to process directories
-void processDirectory(FILE *archive, const char *inputPath, const char *directoryPathFromRoot, ArchiveEntry *entries, int *entryCount)
+// Copies a range of bytes between two files without moving either file position, returning how many bytes were copied.
+// It only comes up short if the input ends early
+long CopyData(int inFd, long inOffset, int outFd, long outOffset, long length)
 {
-    ArchiveEntry *dirEntry = &entries[*entryCount];
-    strcpy(dirEntry->name, directoryPathFromRoot);
-    dirEntry->type = 'D';
+    char buffer[65536];
+    long copied = 0;
+    while (copied < length)
+    {
+        size_t chunk = length - copied < (long)sizeof(buffer) ? (size_t)(length - copied) : sizeof(buffer);
+        ssize_t bytesRead = pread(inFd, buffer, chunk, inOffset + copied);
+        if (bytesRead <= 0)
+            break;
 
-    struct stat st;
-    if (stat(inputPath, &st) != 0)
+        if (pwrite(outFd, buffer, bytesRead, outOffset + copied) != bytesRead)
+        {
+            perror("Failed to write data");
+            exit(EXIT_FAILURE);
+        }
+        copied += bytesRead;
+    }
+    return copied;
+}
+
+// Copies a range of bytes between two files within the kernel using copy_file_range, falling back to
+// CopyData when the files are on filesystems it cannot handle. Returns how many bytes were copied
+long CopyFileRange(int inFd, long inOffset, int outFd, long outOffset, long length)
+{
+    loff_t inPos = inOffset, outPos = outOffset;
+    long copied = 0;
+    while (copied < length)
     {
-        perror("Failed to get directory status");
-        return;
+        ssize_t bytesCopied = copy_file_range(inFd, &inPos, outFd, &outPos, length - copied, 0);
+        if (bytesCopied <= 0)
+            break;
+        copied += bytesCopied;
     }
 
-    dirEntry->size = 0;                // Directory size can be 0 as it holds no "data" itself
-    dirEntry->offset = ftell(archive); // Offset where directory data would be, not applicable here
-    (*entryCount)++;                   // Increment entry count
+    if (copied < length)
+    {
+        copied += CopyData(inFd, inOffset + copied, outFd, outOffset + copied, length - copied);
+    }
+    return copied;
+}
+
+// Copies a range of bytes between two files by sharing their blocks with FICLONERANGE where the filesystem
+// supports reflinks (btrfs, XFS), which takes no time whatever the size. Only block aligned ranges can be shared,
+// so the rest, or everything on other filesystems, goes through CopyFileRange. Returns how many bytes were moved
+// in total, and adds the ones that were shared to clonedBytes when it is given
+long CloneOrCopyRange(int inFd, long inOffset, int outFd, long outOffset, long length, long *clonedBytes)
+{
+    long cloned = 0;
 
-    // // Debug print
-    // printf("Pre-Write Metadata: Name=%s, Type=%c, Offset=%ld, Size=%ld\n\n",
-    //        dirEntry->name, dirEntry->type, dirEntry->offset, dirEntry->size);
+    if (inOffset % ARCHIVE_BLOCK_SIZE == 0 && outOffset % ARCHIVE_BLOCK_SIZE == 0 && length >= ARCHIVE_BLOCK_SIZE)
+    {
+        struct file_clone_range range;
+        range.src_fd = inFd;
+        range.src_offset = inOffset;
+        range.src_length = length - length % ARCHIVE_BLOCK_SIZE;
+        range.dest_offset = outOffset;
 
-    // Open up the directory
-    DIR *dir = opendir(inputPath);
-    if (!dir)
+        if (ioctl(outFd, FICLONERANGE, &range) == 0)
+        {
+            cloned = range.src_length;
+        }
+    }
+
+    if (clonedBytes)
+    {
+        *clonedBytes += cloned;
+    }
+    if (cloned < length)
+    {
+        return cloned + CopyFileRange(inFd, inOffset + cloned, outFd, outOffset + cloned, length - cloned);
+    }
+    return cloned;
+}
+
+// Stops a creation or append before it records more entries than an archive can hold
+void CheckEntryRoom(int entryCount)
+{
+    if (entryCount >= MAX_ARCHIVE_ENTRIES)
+    {
+        fprintf(stderr, "Archive would have more than %d entries\n", MAX_ARCHIVE_ENTRIES);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Recursive function to process directories
+void processDirectory(FILE *archive, const char *inputPath, const char *directoryPathFromRoot, ArchiveEntry *entries, int *entryCount)
+{
+    // A directory restored from a checkpoint is already recorded, but the walk still goes through it for whatever is left
+    if (!ResumedEntry(entries, entryCount, directoryPathFromRoot, 'D'))
+    {
+        CheckEntryRoom(*entryCount);
+        ArchiveEntry *dirEntry = &entries[*entryCount];
+        dirEntry->name = strdup(directoryPathFromRoot);
+        dirEntry->type = 'D';
+
+        struct stat st;
+        if (stat(inputPath, &st) != 0)
+        {
+            perror("Failed to get directory status");
+            return;
+        }
+
+        dirEntry->size = 0;                // Directory size can be 0 as it holds no "data" itself
+        dirEntry->offset = archive ? ftell(archive) : 0; // Offset where directory data would be, not applicable here
+        dirEntry->owner = st.st_uid;
+        dirEntry->group = st.st_gid;
+        dirEntry->rights = st.st_mode;
+        dirEntry->volume = 0;
+        (*entryCount)++;                   // Increment entry count
+        CheckpointProgress(archive, entries, *entryCount);
+
+        // // Debug print
+        // printf("Pre-Write Metadata: Name=%s, Type=%c, Offset=%ld, Size=%ld\n\n",
+        //        dirEntry->name, dirEntry->type, dirEntry->offset, dirEntry->size);
+    }
+
+    // We read all contents from the directory table, sorted so that a resumed walk comes across them in the same order as before
+    struct dirent **contents;
+    int numContents = scandir(inputPath, &contents, NULL, alphasort);
+    if (numContents < 0)
     {
         perror("Failed to open directory");
         return;
     }
 
-    // We read all contents from the directory table:
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL)
+    for (int i = 0; i < numContents; i++)
     {
+        struct dirent *entry = contents[i];
+
         // We skip the first two entries which are '.' and '..'
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
             continue;
@@ -226,14 +545,31 @@ void processDirectory(FILE *archive, const char *inputPath, const char *director
             processDirectory(archive, fullPath, fullPathfromRoot, entries, entryCount);
         }
 
-        // Otherwise if it's a file we can write its content to the archive and record its metadata
-        else
+        // Otherwise if it's a file we can write its content to the archive and record its metadata, unless the checkpoint already has it
+        else if (!ResumedEntry(entries, entryCount, fullPathfromRoot, 'F'))
         {
-            writeFileToArchive(archive, fullPath, fullPathfromRoot, &entries[*entryCount]);
+            CheckEntryRoom(*entryCount);
+
+            // A file we cannot archive is still recorded, as dropped, until the walk is over. That way a checkpoint
+            // remembers the walk already came across it, and a resumed walk passes over it the same way
+            if (!writeFileToArchive(archive, fullPath, fullPathfromRoot, &entries[*entryCount]))
+            {
+                ArchiveEntry *dropped = &entries[*entryCount];
+                memset(dropped, 0, sizeof(ArchiveEntry));
+                dropped->name = strdup(fullPathfromRoot);
+                dropped->type = DROPPED_ENTRY;
+                dropped->offset = archive ? ftell(archive) : 0;
+            }
             (*entryCount)++;
+            CheckpointProgress(archive, entries, *entryCount);
         }
     }
-    closedir(dir);
+
+    for (int i = 0; i < numContents; i++)
+    {
+        free(contents[i]);
+    }
+    free(contents);
 }
 
 // Creates a directory if it doesn't exist - invoked from the extraction function
@@ -266,6 +602,16 @@ void trimTrailingSpaces(char *str)
     str[len] = '\0';
 }
 
+// Drops the slashes a path ends in, so "dir/" names the same thing as "dir" (a lone "/" is left alone)
+void TrimTrailingSlashes(char *path)
+{
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+    {
+        path[--len] = '\0';
+    }
+}
+
 // Function to check if the archive file exists
 void CheckIfArchiveExists(const char *archiveFile)
 {
@@ -349,7 +695,7 @@ void DisplayHierarchy(ArchiveEntry *entries, int numEntries, int level, const ch
                 // If it's a directory, recursively display its contents
                 if (entry.type == 'D')
                 {
-                    char subPath[256];
+                    char subPath[PATH_MAX];
                     snprintf(subPath, sizeof(subPath), "%s%s/", parentPath, remainingPath);
                     DisplayHierarchy(entries, numEntries, level + 1, subPath);
                 }
@@ -364,13 +710,16 @@ void GenerateUniqueEntryName(ArchiveEntry *entries, int entryCount, char *name)
     int count = 1;
     size_t len = strlen(name);
 
+    // Every candidate is built from the original name, so we get "file 2.txt" rather than "file 1 2.txt"
+    char *originalName = strdup(name);
+
     // Find the position of the last '.' in the filename to handle the extension
-    char *dotPos = strrchr(name, '.');
-    size_t baseLen = (dotPos) ? (dotPos - name) : len;
+    char *dotPos = strrchr(originalName, '.');
+    size_t baseLen = (dotPos) ? (size_t)(dotPos - originalName) : len;
 
     // Making some space for the number and potential extension change
     char *newName = malloc(len + 10);
-    if (newName == NULL)
+    if (newName == NULL || originalName == NULL)
     {
         perror("Memory allocation failed");
         exit(EXIT_FAILURE);
@@ -392,12 +741,12 @@ void GenerateUniqueEntryName(ArchiveEntry *entries, int entryCount, char *name)
                 if (dotPos)
                 {
                     // If there's an extension, insert the count before the extension
-                    snprintf(newName, len + 10, "%.*s %d%s", (int)baseLen, name, count, dotPos);
+                    snprintf(newName, len + 10, "%.*s %d%s", (int)baseLen, originalName, count, dotPos);
                 }
                 else
                 {
                     // If there's no extension, just append the count
-                    snprintf(newName, len + 10, "%s %d", name, count);
+                    snprintf(newName, len + 10, "%s %d", originalName, count);
                 }
 
                 count++;
@@ -416,394 +765,3165 @@ void GenerateUniqueEntryName(ArchiveEntry *entries, int entryCount, char *name)
     }
 
     free(newName);
+    free(originalName);
 }
 
-//================================================================ CREATION ================================================================================
-// Function to initialize an archive
-void CreateArchive(const char *archiveFile, char *inputPath)
+//================================================================ ARCHIVE FORMAT ================================================================================
+// CRC-32 (IEEE) used to validate the header slots and the metadata table they point at
+unsigned int Checksum32(const void *data, size_t length, unsigned int crc)
 {
-    CheckIfInputPathExists(inputPath);
+    static unsigned int table[256];
+    static int tableReady = 0;
 
-    // Open the archive file as writing binary mode
-    FILE *archive = fopen(archiveFile, "wb+");
-    if (!archive)
+    // Build the lookup table the first time we are called
+    if (!tableReady)
     {
-        perror("Failed to create archive file");
-        exit(EXIT_FAILURE);
+        for (unsigned int i = 0; i < 256; i++)
+        {
+            unsigned int value = i;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                value = (value & 1) ? (0xEDB88320u ^ (value >> 1)) : (value >> 1);
+            }
+            table[i] = value;
+        }
+        tableReady = 1;
     }
 
-    // Initialize the header for having initially 0 offset and 0 entries
-    ArchiveHeader header = {0, 0};
-    fwrite(&header, sizeof(ArchiveHeader), 1, archive); // Reserve space for the header on the archive
-
-    // For now we will just have a cap of 1000 entries, plan to make this dynamic later
-    ArchiveEntry entries[1000];
-    int entryCount = 0;
-
-    // Get information about the inputPath provided
-    struct stat path_stat;
-    stat(inputPath, &path_stat);
+    const unsigned char *bytes = data;
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+    {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
 
-    // Extract only the last part of the path to get the root of this archive
-    char *rootOfArchive = strrchr(inputPath, '/');
-    if (rootOfArchive)
+// Flushes everything written so far out of stdio, and in durable mode all the way to stable storage
+void SyncArchive(FILE *archive)
+{
+    if (fflush(archive) != 0)
     {
-        rootOfArchive++; // Skip the slash to get only the name or directory
+        perror("Failed to flush archive file");
+        exit(EXIT_FAILURE);
     }
-    else
+
+    if (options.durable && fdatasync(fileno(archive)) != 0)
     {
-        rootOfArchive = inputPath; // The path does not contain any slashes
+        perror("Failed to sync archive file");
+        exit(EXIT_FAILURE);
     }
+}
 
-    // Debug to check what the root of the archive is
-    // printf("Root of Archive: %s\n", rootOfArchive);
+// In durable mode a newly created archive also needs its directory entry on stable storage
+void SyncParentDirectory(const char *archiveFile)
+{
+    if (!options.durable)
+        return;
 
-    // If it's a directory then we will process the directory into the archive
-    if (S_ISDIR(path_stat.st_mode))
+    // Figure out which directory the archive lives in
+    char parentPath[PATH_MAX];
+    snprintf(parentPath, sizeof(parentPath), "%s", archiveFile);
+    char *slashPos = strrchr(parentPath, '/');
+    if (slashPos)
     {
-        processDirectory(archive, inputPath, rootOfArchive, entries, &entryCount);
+        *(slashPos + 1) = '\0';
     }
-
-    // Otherwise we will simply call the function to write the file directly into the archive
     else
     {
-        writeFileToArchive(archive, inputPath, rootOfArchive, &entries[entryCount]);
-        entryCount++;
+        strcpy(parentPath, ".");
     }
 
-    // Update all header metadata at the end of the archive
-    header.metadataOffset = ftell(archive);
-    header.numEntries = entryCount;
-
-    fseek(archive, 0, SEEK_END);
-    // For each entry we will update their metadata into the metadata section of the archive
-    for (int i = 0; i < entryCount; i++)
+    int dirFd = open(parentPath, O_RDONLY | O_DIRECTORY);
+    if (dirFd == -1 || fsync(dirFd) != 0)
     {
-        if (fwrite(&entries[i], sizeof(ArchiveEntry), 1, archive) != 1)
-        {
-            perror("Failed to write metadata entry");
-        }
+        perror("Failed to sync archive directory");
+        exit(EXIT_FAILURE);
     }
+    close(dirFd);
+}
+
+// Writes the superblock and two empty (invalid) header slots, leaving the archive positioned at the data area
+void InitializeArchiveHeader(FILE *archive)
+{
+    char headerArea[ARCHIVE_HEADER_SIZE] = {0};
+    ArchiveSuperblock superblock = {ARCHIVE_MAGIC, ARCHIVE_VERSION, ARCHIVE_HEADER_SIZE};
+    memcpy(headerArea, &superblock, sizeof(ArchiveSuperblock));
 
-    // Go back to the beginning and write the header
-    rewind(archive);
-    if (fwrite(&header, sizeof(ArchiveHeader), 1, archive) != 1)
+    if (fwrite(headerArea, sizeof(headerArea), 1, archive) != 1)
     {
         perror("Failed to write archive header");
+        exit(EXIT_FAILURE);
     }
+}
 
-    // // Test read header, metadata
-    // // Rewind and read the header to print its contents
-    // rewind(archive);
-    // if (fread(&header, sizeof(ArchiveHeader), 1, archive) == 1)
-    // {
-    //     printf("Header Read: MetadataOffset=%ld, NumberOfEntries=%d\n\n",
-    //            header.metadataOffset, header.numEntries);
-    // }
-    // else
-    // {
-    //     perror("Failed to read archive header for verification");
-    // }
+// Appends an unsigned LEB128 varint to the buffer
+void PutVarint(unsigned char **cursor, unsigned long value)
+{
+    while (value >= 0x80)
+    {
+        *(*cursor)++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *(*cursor)++ = (unsigned char)value;
+}
 
-    // fseek(archive, header.metadataOffset, SEEK_SET);
-    // for (int i = 0; i < header.numEntries; i++)
-    // {
-    //     ArchiveEntry testEntry;
-    //     if (fread(&testEntry, sizeof(ArchiveEntry), 1, archive) == 1)
-    //     {
-    //         printf("Test Read Entry: Name=%s, Type=%c, Offset=%ld, Size=%ld\n",
-    //                testEntry.name, testEntry.type, testEntry.offset, testEntry.size);
-    //     }
-    //     else
-    //     {
-    //         perror("Failed to read metadata for testing");
-    //     }
-    // }
+// Reads an unsigned LEB128 varint, returning 0 if it runs past the end of the buffer
+int GetVarint(const unsigned char **cursor, const unsigned char *end, unsigned long *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (*cursor >= end)
+            return 0;
+        unsigned char byte = *(*cursor)++;
+        *value |= (unsigned long)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return 1;
+    }
+    return 0;
+}
 
-    fclose(archive);
-    printf("Archive created successfully\n");
+// Offsets are stored relative to where the previous entry's data ended, zigzag encoded in case they go backwards
+unsigned long ZigzagEncode(long value)
+{
+    return ((unsigned long)value << 1) ^ (unsigned long)(value >> 63);
 }
 
-//================================================================ APPENDING ================================================================================
-// This function will help to append a file or directory into the archive
-void AppendToArchive(const char *archiveFile, char *inputPath)
+long ZigzagDecode(unsigned long value)
 {
-    CheckIfArchiveExists(archiveFile);
-    CheckIfInputPathExists(inputPath);
+    return (long)(value >> 1) ^ -(long)(value & 1);
+}
 
-    // Open the archive file in read-write mode
-    FILE *archive = fopen(archiveFile, "rb+");
-    if (!archive)
+// Encodes the metadata table in the layout of the given archive version. The caller frees the returned buffer.
+//
+// Version 1 and 2 archives use a table of FixedArchiveEntry. Version 3 archives front-code each entry against the previous one:
+//   type, [volume], shared name prefix length, suffix length, suffix, size, offset delta, owner, group, rights
+// where every number is a varint, which usually brings an entry down from 290 bytes to a dozen or two.
+// The volume is only there for data in a volume file, flagged by the top bit of the type
+unsigned char *EncodeMetadata(int version, ArchiveEntry *entries, int numEntries, long *metadataSize)
+{
+    // Work out the worst case size so the buffer never needs to grow
+    size_t capacity = 1;
+    for (int i = 0; i < numEntries; i++)
     {
-        perror("Failed to open archive file for appending");
-        exit(EXIT_FAILURE);
+        capacity += sizeof(FixedArchiveEntry) + 1 + 7 * 10 + strlen(entries[i].name);
     }
 
-    // Read the header information from the archive file
-    ArchiveHeader header;
-    if (fread(&header, sizeof(ArchiveHeader), 1, archive) != 1)
+    unsigned char *metadata = malloc(capacity);
+    if (metadata == NULL)
     {
-        perror("Failed to read archive header");
-        fclose(archive);
+        perror("Memory allocation failed");
         exit(EXIT_FAILURE);
     }
 
-    // Move to the metadata section
-    fseek(archive, header.metadataOffset, SEEK_SET);
-
-    // Read existing metadata entries
-    ArchiveEntry entries[1000];
-    if (fread(entries, sizeof(ArchiveEntry), header.numEntries, archive) != header.numEntries)
+    unsigned char *cursor = metadata;
+    const char *previousName = "";
+    long nextOffset = 0;
+    for (int i = 0; i < numEntries; i++)
     {
-        perror("Failed to read existing metadata entries");
-        fclose(archive);
-        exit(EXIT_FAILURE);
-    }
+        ArchiveEntry *entry = &entries[i];
+        size_t nameLen = strlen(entry->name);
 
-    // Update entry count
-    int entryCount = header.numEntries;
+        if (version < ARCHIVE_VERSION)
+        {
+            FixedArchiveEntry fixed = {0};
+            if (nameLen >= sizeof(fixed.name))
+            {
+                fprintf(stderr, "Path '%s' is too long for a version %d archive\n", entry->name, version);
+                exit(EXIT_FAILURE);
+            }
+            fixed.type = entry->type;
+            fixed.size = entry->size;
+            fixed.offset = entry->offset;
+            memcpy(fixed.name, entry->name, nameLen);
+            fixed.owner = entry->owner;
+            fixed.group = entry->group;
+            fixed.rights = entry->rights;
+            memcpy(cursor, &fixed, sizeof(FixedArchiveEntry));
+            cursor += sizeof(FixedArchiveEntry);
+            continue;
+        }
 
-    // Debug check to see if all entries have been read properly
-    // for(int i=0; i <entryCount; i++) {
-    //     printf("Reading in:\nName=%s\n Type=%c\n Size=%ld\n Offset=%ld\n", entries[i].name, entries[i].type, entries[i].size, entries[i].offset);
+        // How much of the name is the same as the previous one, which is most of it in a directory walk
+        size_t shared = 0;
+        while (previousName[shared] != '\0' && previousName[shared] == entry->name[shared])
+        {
+            shared++;
+        }
+
+        if (entry->volume == 0)
+        {
+            *cursor++ = (unsigned char)entry->type;
+        }
+        else
+        {
+            *cursor++ = (unsigned char)entry->type | 0x80;
+            PutVarint(&cursor, entry->volume);
+        }
+        PutVarint(&cursor, shared);
+        PutVarint(&cursor, nameLen - shared);
+        memcpy(cursor, entry->name + shared, nameLen - shared);
+        cursor += nameLen - shared;
+        PutVarint(&cursor, entry->size);
+        PutVarint(&cursor, ZigzagEncode(entry->offset - nextOffset));
+        PutVarint(&cursor, entry->owner);
+        PutVarint(&cursor, entry->group);
+        PutVarint(&cursor, entry->rights);
+
+        previousName = entry->name;
+        nextOffset = entry->offset + entry->size;
+    }
+
+    *metadataSize = cursor - metadata;
+    return metadata;
+}
+
+// Decodes a metadata table written by EncodeMetadata, returning 0 if it is malformed
+int DecodeMetadata(int version, const unsigned char *metadata, long metadataSize, int numEntries, ArchiveEntry *entries)
+{
+    if (version < ARCHIVE_VERSION)
+    {
+        if (metadataSize != (long)numEntries * (long)sizeof(FixedArchiveEntry))
+            return 0;
+
+        for (int i = 0; i < numEntries; i++)
+        {
+            FixedArchiveEntry fixed;
+            memcpy(&fixed, metadata + i * sizeof(FixedArchiveEntry), sizeof(FixedArchiveEntry));
+            entries[i].type = fixed.type;
+            entries[i].size = fixed.size;
+            entries[i].offset = fixed.offset;
+            entries[i].name = strndup(fixed.name, sizeof(fixed.name));
+            entries[i].owner = fixed.owner;
+            entries[i].group = fixed.group;
+            entries[i].rights = fixed.rights;
+            entries[i].volume = 0;
+        }
+        return 1;
+    }
+
+    const unsigned char *cursor = metadata;
+    const unsigned char *end = metadata + metadataSize;
+    const char *previousName = "";
+    long nextOffset = 0;
+    for (int i = 0; i < numEntries; i++)
+    {
+        unsigned long volume = 0, shared, suffixLen, size, offsetDelta, owner, group, rights;
+        if (cursor >= end)
+            return 0;
+        char type = (char)(*cursor & 0x7F);
+        if ((*cursor++ & 0x80) && !GetVarint(&cursor, end, &volume))
+            return 0;
+        if (!GetVarint(&cursor, end, &shared) || !GetVarint(&cursor, end, &suffixLen))
+            return 0;
+        if (shared > strlen(previousName) || suffixLen > (unsigned long)(end - cursor))
+            return 0;
+
+        // Rebuild the full name from the previous one
+        char *name = malloc(shared + suffixLen + 1);
+        if (name == NULL)
+        {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(name, previousName, shared);
+        memcpy(name + shared, cursor, suffixLen);
+        name[shared + suffixLen] = '\0';
+        cursor += suffixLen;
+
+        if (!GetVarint(&cursor, end, &size) || !GetVarint(&cursor, end, &offsetDelta) || !GetVarint(&cursor, end, &owner) || !GetVarint(&cursor, end, &group) || !GetVarint(&cursor, end, &rights))
+        {
+            free(name);
+            return 0;
+        }
+
+        entries[i].type = type;
+        entries[i].size = size;
+        entries[i].offset = nextOffset + ZigzagDecode(offsetDelta);
+        entries[i].name = name;
+        entries[i].owner = owner;
+        entries[i].group = group;
+        entries[i].rights = rights;
+        entries[i].volume = volume;
+
+        previousName = name;
+        nextOffset = entries[i].offset + entries[i].size;
+    }
+
+    return cursor == end;
+}
+
+// Reads a metadata table into a freshly allocated buffer, returning NULL if it is not all there
+unsigned char *ReadMetadata(FILE *archive, long metadataOffset, long metadataSize)
+{
+    struct stat st;
+    if (fstat(fileno(archive), &st) != 0 || metadataOffset < 0 || metadataSize < 0 || metadataOffset + metadataSize > st.st_size)
+        return NULL;
+
+    unsigned char *metadata = malloc(metadataSize + 1);
+    if (metadata == NULL)
+    {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pread(fileno(archive), metadata, metadataSize, metadataOffset) != metadataSize)
+    {
+        free(metadata);
+        return NULL;
+    }
+    return metadata;
+}
+
+// Reads both header slots and keeps the ones whose checksum holds, newest generation first. Returns how many there are
+int ReadHeaderSlots(FILE *archive, ArchiveHeaderSlot *slots)
+{
+    int validSlots = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        ArchiveHeaderSlot slot;
+        if (pread(fileno(archive), &slot, sizeof(ArchiveHeaderSlot), ARCHIVE_SLOT_OFFSET(i)) != sizeof(ArchiveHeaderSlot))
+            continue;
+        if (slot.generation == 0 || slot.checksum != Checksum32(&slot, offsetof(ArchiveHeaderSlot, checksum), 0))
+            continue;
+        if (slot.numEntries < 0 || slot.numEntries > MAX_ARCHIVE_ENTRIES)
+            continue;
+        if (slot.numSummaries < 0 || slot.numSummaries > slot.numEntries || slot.numVolumes < 0)
+            continue;
+
+        slots[validSlots++] = slot;
+    }
+    if (validSlots == 2 && slots[1].generation > slots[0].generation)
+    {
+        ArchiveHeaderSlot newer = slots[1];
+        slots[1] = slots[0];
+        slots[0] = newer;
+    }
+    return validSlots;
+}
+
+// Reads the newest committed header of the archive along with its metadata entries.
+// Returns the archive version, or -1 if the archive cannot be read
+int LoadArchive(FILE *archive, ArchiveHeaderSlot *header, ArchiveEntry *entries)
+{
+    // The header area is read with pread, so nothing stale in the stdio buffer can hide a newer commit from us
+    unsigned char start[sizeof(ArchiveSuperblock)];
+    ssize_t startRead = pread(fileno(archive), start, sizeof(start), 0);
+    size_t bytesRead = startRead > 0 ? (size_t)startRead : 0;
+
+    memset(header, 0, sizeof(ArchiveHeaderSlot));
+
+    // Creation was interrupted before even the header area made it into the file, so this is an empty archive
+    if (bytesRead == 0)
+    {
+        header->metadataOffset = ARCHIVE_HEADER_SIZE;
+        return ARCHIVE_VERSION;
+    }
+
+    // Legacy archives have no superblock, the bare header sits at the start of the file
+    if (bytesRead < sizeof(start) || memcmp(start, ARCHIVE_MAGIC, 8) != 0)
+    {
+        ArchiveHeader legacyHeader;
+        if (bytesRead < sizeof(ArchiveHeader))
+        {
+            fprintf(stderr, "Failed to read archive header\n");
+            return -1;
+        }
+        memcpy(&legacyHeader, start, sizeof(ArchiveHeader));
+
+        if (legacyHeader.numEntries < 0 || legacyHeader.numEntries > MAX_ARCHIVE_ENTRIES)
+        {
+            fprintf(stderr, "Archive header is corrupt\n");
+            return -1;
+        }
+
+        header->metadataOffset = legacyHeader.metadataOffset;
+        header->numEntries = legacyHeader.numEntries;
+        header->metadataSize = (long)legacyHeader.numEntries * sizeof(FixedArchiveEntry);
+
+        unsigned char *metadata = ReadMetadata(archive, header->metadataOffset, header->metadataSize);
+        if (metadata == NULL)
+        {
+            fprintf(stderr, "Failed to read existing metadata entries\n");
+            return -1;
+        }
+        DecodeMetadata(ARCHIVE_VERSION_LEGACY, metadata, header->metadataSize, header->numEntries, entries);
+        free(metadata);
+        return ARCHIVE_VERSION_LEGACY;
+    }
+
+    ArchiveSuperblock superblock;
+    memcpy(&superblock, start, sizeof(ArchiveSuperblock));
+    if (superblock.version > ARCHIVE_VERSION)
+    {
+        fprintf(stderr, "Archive format version %d is newer than this adzip supports\n", superblock.version);
+        return -1;
+    }
+
+    // Appends never touch anything a committed header points at, they only rewrite the slot of the older generation.
+    // So whatever slot we read intact gives a consistent snapshot, and if a commit racing with us tore the slot
+    // we wanted we simply look again
+    for (int attempt = 0; attempt < LOAD_ATTEMPTS; attempt++)
+    {
+        if (attempt > 0)
+        {
+            usleep(1000);
+        }
+
+        ArchiveHeaderSlot slots[2];
+        int validSlots = ReadHeaderSlots(archive, slots);
+
+        // Nothing was ever committed, e.g. creation was interrupted, so this is an empty archive
+        if (validSlots == 0 && attempt == LOAD_ATTEMPTS - 1)
+        {
+            header->metadataOffset = ARCHIVE_HEADER_SIZE;
+            return superblock.version;
+        }
+
+        // Use the newest slot whose metadata made it to disk intact, falling back to the previous generation
+        for (int i = 0; i < validSlots; i++)
+        {
+            unsigned char *metadata = ReadMetadata(archive, slots[i].metadataOffset, slots[i].metadataSize);
+            if (metadata == NULL)
+                continue;
+
+            int intact = Checksum32(metadata, slots[i].metadataSize, 0) == slots[i].metadataChecksum &&
+                         DecodeMetadata(superblock.version, metadata, slots[i].metadataSize, slots[i].numEntries, entries);
+            free(metadata);
+
+            // Every entry has to point into a volume the archive actually has
+            for (int j = 0; intact && j < slots[i].numEntries; j++)
+            {
+                intact = entries[j].volume <= slots[i].numVolumes;
+            }
+
+            // This generation is now pinned: everything it points at stays as it is no matter what gets appended
+            if (intact)
+            {
+                *header = slots[i];
+                return superblock.version;
+            }
+        }
+    }
+
+    fprintf(stderr, "Archive metadata is corrupt\n");
+    return -1;
+}
+
+// Writes the metadata table at the current position and records it in the header about to be committed
+void WriteArchiveMetadata(FILE *archive, int version, ArchiveHeaderSlot *header, ArchiveEntry *entries)
+{
+    header->metadataOffset = ftell(archive);
+    unsigned char *metadata = EncodeMetadata(version, entries, header->numEntries, &header->metadataSize);
+    header->metadataChecksum = Checksum32(metadata, header->metadataSize, 0);
+
+    if (fwrite(metadata, 1, header->metadataSize, archive) != (size_t)header->metadataSize)
+    {
+        perror("Failed to write metadata entries");
+        exit(EXIT_FAILURE);
+    }
+    free(metadata);
+}
+
+// Counts how many levels deep an entry is, top-level entries being at depth 0
+int EntryDepth(const char *name)
+{
+    int depth = 0;
+    for (const char *c = name; *c; c++)
+    {
+        if (*c == '/')
+            depth++;
+    }
+    return depth;
+}
+
+// Computes the aggregates of every directory entry in a single pass over the metadata.
+// A directory's descendants always follow it, so we keep a stack of the directories the current entry is inside of
+int SummarizeDirectories(ArchiveEntry *entries, int numEntries, DirectorySummary *summaries)
+{
+    int numSummaries = 0;
+    int openDirs[MAX_ARCHIVE_ENTRIES];
+    int numOpen = 0;
+
+    for (int i = 0; i < numEntries; i++)
+    {
+        int depth = EntryDepth(entries[i].name);
+
+        // Close every directory this entry is not inside of
+        while (numOpen > 0)
+        {
+            const char *dirName = entries[summaries[openDirs[numOpen - 1]].entryIndex].name;
+            size_t dirLen = strlen(dirName);
+            if (strncmp(entries[i].name, dirName, dirLen) == 0 && entries[i].name[dirLen] == '/')
+                break;
+            numOpen--;
+        }
+
+        // Roll this entry up into every directory it is inside of
+        for (int j = 0; j < numOpen; j++)
+        {
+            DirectorySummary *parent = &summaries[openDirs[j]];
+            int relativeDepth = depth - EntryDepth(entries[parent->entryIndex].name);
+            if (relativeDepth > parent->maxDepth)
+                parent->maxDepth = relativeDepth;
+            if (entries[i].type == 'F')
+            {
+                parent->totalBytes += entries[i].size;
+                parent->fileCount++;
+            }
+        }
+
+        if (entries[i].type == 'D')
+        {
+            DirectorySummary summary = {i, 0, 0, 0};
+            summaries[numSummaries] = summary;
+            openDirs[numOpen++] = numSummaries++;
+        }
+    }
+
+    return numSummaries;
+}
+
+// Writes the directory summaries right after the metadata and records them in the header about to be committed
+void WriteDirectorySummaries(FILE *archive, ArchiveHeaderSlot *header, ArchiveEntry *entries)
+{
+    DirectorySummary summaries[MAX_ARCHIVE_ENTRIES];
+    int numSummaries = SummarizeDirectories(entries, header->numEntries, summaries);
+
+    header->summaryOffset = ftell(archive);
+    header->numSummaries = numSummaries;
+    header->summaryChecksum = Checksum32(summaries, numSummaries * sizeof(DirectorySummary), 0);
+
+    if (fwrite(summaries, sizeof(DirectorySummary), numSummaries, archive) != (size_t)numSummaries)
+    {
+        perror("Failed to write directory summaries");
+        exit(EXIT_FAILURE);
+    }
+
+    // The directory names follow (each ending in a '\0'), so du style questions never need the metadata decoded.
+    // They end in a CRC-32 of their own, since the summary checksum has only ever covered the summaries
+    unsigned int namesChecksum = 0;
+    header->summaryNamesSize = 0;
+    for (int i = 0; i < numSummaries; i++)
+    {
+        const char *name = entries[summaries[i].entryIndex].name;
+        size_t length = strlen(name) + 1;
+        if (fwrite(name, 1, length, archive) != length)
+        {
+            perror("Failed to write directory summaries");
+            exit(EXIT_FAILURE);
+        }
+        namesChecksum = Checksum32(name, length, namesChecksum);
+        header->summaryNamesSize += length;
+    }
+
+    if (fwrite(&namesChecksum, sizeof(namesChecksum), 1, archive) != 1)
+    {
+        perror("Failed to write directory summaries");
+        exit(EXIT_FAILURE);
+    }
+    header->summaryNamesSize += sizeof(namesChecksum);
+}
+
+// Reads the directory summaries of the committed header. Archives written without them get them computed from the metadata
+int LoadDirectorySummaries(FILE *archive, const ArchiveHeaderSlot *header, ArchiveEntry *entries, DirectorySummary *summaries)
+{
+    if (header->summaryOffset != 0)
+    {
+        size_t summarySize = header->numSummaries * sizeof(DirectorySummary);
+        if (pread(fileno(archive), summaries, summarySize, header->summaryOffset) == (ssize_t)summarySize && Checksum32(summaries, summarySize, 0) == header->summaryChecksum)
+        {
+            return header->numSummaries;
+        }
+        fprintf(stderr, "Directory summaries are corrupt, recomputing them from the metadata\n");
+    }
+
+    return SummarizeDirectories(entries, header->numEntries, summaries);
+}
+
+// Reads the directory summaries of the newest committed header along with the directory names, without the metadata.
+// Returns how many there are, or -1 if the archive has no names to go by (legacy archives and ones written before them)
+int LoadSummaryIndex(FILE *archive, DirectorySummary *summaries, char **names)
+{
+    ArchiveSuperblock superblock;
+    if (pread(fileno(archive), &superblock, sizeof(superblock), 0) != sizeof(superblock) || memcmp(superblock.magic, ARCHIVE_MAGIC, 8) != 0)
+        return -1;
+
+    // Same snapshot rules as LoadArchive, the summaries and names are never touched once a header points at them
+    for (int attempt = 0; attempt < LOAD_ATTEMPTS; attempt++)
+    {
+        if (attempt > 0)
+        {
+            usleep(1000);
+        }
+
+        ArchiveHeaderSlot slots[2];
+        int validSlots = ReadHeaderSlots(archive, slots);
+
+        // Nothing was ever committed, so there are no directories
+        if (validSlots == 0 && attempt == LOAD_ATTEMPTS - 1)
+            return 0;
+
+        for (int i = 0; i < validSlots; i++)
+        {
+            if (slots[i].summaryNamesSize == 0)
+                return -1;
+
+            long summarySize = slots[i].numSummaries * (long)sizeof(DirectorySummary);
+            long namesSize = slots[i].summaryNamesSize - (long)sizeof(unsigned int);
+            unsigned char *section = namesSize < 0 ? NULL : ReadMetadata(archive, slots[i].summaryOffset, summarySize + slots[i].summaryNamesSize);
+            if (section == NULL)
+                continue;
+
+            unsigned int namesChecksum;
+            memcpy(&namesChecksum, section + summarySize + namesSize, sizeof(namesChecksum));
+            int intact = Checksum32(section, summarySize, 0) == slots[i].summaryChecksum &&
+                         Checksum32(section + summarySize, namesSize, 0) == namesChecksum &&
+                         (namesSize == 0 || section[summarySize + namesSize - 1] == '\0');
+
+            // One name per summary, in the same order
+            const char *name = (const char *)section + summarySize;
+            for (int j = 0; intact && j < slots[i].numSummaries; j++)
+            {
+                if (name >= (const char *)section + summarySize + namesSize)
+                {
+                    intact = 0;
+                    break;
+                }
+                names[j] = strdup(name);
+                name += strlen(name) + 1;
+            }
+
+            if (intact)
+            {
+                memcpy(summaries, section, summarySize);
+            }
+            free(section);
+            if (intact)
+                return slots[i].numSummaries;
+        }
+    }
+    return -1;
+}
+
+// Publishes a new header once the data and metadata it points at have been written.
+// Data and metadata are synced first, so the header can never point at anything that is not on disk yet
+void CommitArchiveHeader(FILE *archive, int version, ArchiveHeaderSlot *header)
+{
+    SyncArchive(archive);
+
+    // Legacy archives only have the one header, which we have no choice but to overwrite in place
+    if (version == ARCHIVE_VERSION_LEGACY)
+    {
+        ArchiveHeader legacyHeader = {header->metadataOffset, header->numEntries};
+        rewind(archive);
+        if (fwrite(&legacyHeader, sizeof(ArchiveHeader), 1, archive) != 1)
+        {
+            perror("Failed to write archive header");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Otherwise the next generation goes into the slot the current one does not occupy
+    else
+    {
+        header->generation++;
+        header->checksum = Checksum32(header, offsetof(ArchiveHeaderSlot, checksum), 0);
+
+        fseek(archive, ARCHIVE_SLOT_OFFSET(header->generation), SEEK_SET);
+        if (fwrite(header, sizeof(ArchiveHeaderSlot), 1, archive) != 1)
+        {
+            perror("Failed to write archive header");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    SyncArchive(archive);
+}
+
+//================================================================ VOLUMES ================================================================================
+// The files of one volume, which get written or extracted by a thread of their own
+typedef struct
+{
+    int volume;           // Which volume this is, starting at 1
+    char *path;           // Where the volume file is
+    ArchiveEntry *entries;
+    int numEntries;
+    const char *basePath; // Creation: the path being archived, Extraction: the directory to extract into
+    size_t rootLen;       // Creation: length of the archived root name the entry names start with
+    long volumeSize;      // Creation: how many bytes of data end up in this volume
+    int missingFiles;     // Extraction: how many files came out short because the volume is missing their data
+} VolumeWork;
+
+// Builds the path of a volume file as it is recorded in the archive. Volumes next to the archive are recorded
+// relative to it so the whole set can be moved around, volumes in other directories are recorded in full
+char *NewVolumePath(const char *archiveFile, int volume)
+{
+    const char *baseName = strrchr(archiveFile, '/') ? strrchr(archiveFile, '/') + 1 : archiveFile;
+    char path[PATH_MAX];
+
+    if (options.volumeDirs)
+    {
+        // Pick the volume's directory out of the colon separated list
+        const char *dir = options.volumeDirs;
+        for (int i = 1; i < volume; i++)
+        {
+            dir = strchr(dir, ':') + 1;
+        }
+        size_t dirLen = strchr(dir, ':') ? (size_t)(strchr(dir, ':') - dir) : strlen(dir);
+
+        char dirPath[PATH_MAX], absoluteDir[PATH_MAX];
+        snprintf(dirPath, sizeof(dirPath), "%.*s", (int)dirLen, dir);
+        if (!realpath(dirPath, absoluteDir))
+        {
+            fprintf(stderr, "Volume directory '%s' does not exist\n", dirPath);
+            exit(EXIT_FAILURE);
+        }
+        if (snprintf(path, sizeof(path), "%s/%s.%d", absoluteDir, baseName, volume) >= (int)sizeof(path))
+        {
+            fprintf(stderr, "Path of volume %d in '%s' is too long\n", volume, absoluteDir);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (snprintf(path, sizeof(path), "%s.%d", baseName, volume) >= (int)sizeof(path))
+    {
+        fprintf(stderr, "Path of volume %d of '%s' is too long\n", volume, baseName);
+        exit(EXIT_FAILURE);
+    }
+
+    return strdup(path);
+}
+
+// Turns a volume path recorded in the archive into one we can open
+char *ResolveVolumePath(const char *archiveFile, const char *recordedPath)
+{
+    char path[PATH_MAX];
+    const char *slashPos = strrchr(archiveFile, '/');
+
+    if (recordedPath[0] == '/' || !slashPos)
+    {
+        snprintf(path, sizeof(path), "%s", recordedPath);
+    }
+    else
+    {
+        snprintf(path, sizeof(path), "%.*s%s", (int)(slashPos + 1 - archiveFile), archiveFile, recordedPath);
+    }
+
+    return strdup(path);
+}
+
+// Writes the volume paths (one after the other, each ending in a '\0') and records them in the header about to be committed
+void WriteVolumeTable(FILE *archive, ArchiveHeaderSlot *header, char **volumePaths, int numVolumes)
+{
+    header->volumeTableOffset = ftell(archive);
+    header->volumeTableSize = 0;
+    header->numVolumes = numVolumes;
+    header->volumeTableChecksum = 0;
+
+    for (int i = 0; i < numVolumes; i++)
+    {
+        size_t length = strlen(volumePaths[i]) + 1;
+        if (fwrite(volumePaths[i], 1, length, archive) != length)
+        {
+            perror("Failed to write volume table");
+            exit(EXIT_FAILURE);
+        }
+        header->volumeTableSize += length;
+        header->volumeTableChecksum = Checksum32(volumePaths[i], length, header->volumeTableChecksum);
+    }
+}
+
+// Reads the volume paths of the committed header, ready to be opened. Index 0 is the archive file itself
+char **LoadVolumeTable(FILE *archive, const char *archiveFile, const ArchiveHeaderSlot *header)
+{
+    char **volumePaths = calloc(header->numVolumes + 1, sizeof(char *));
+    if (volumePaths == NULL)
+    {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    volumePaths[0] = strdup(archiveFile);
+
+    if (header->numVolumes == 0)
+        return volumePaths;
+
+    unsigned char *table = ReadMetadata(archive, header->volumeTableOffset, header->volumeTableSize);
+    if (table == NULL || Checksum32(table, header->volumeTableSize, 0) != header->volumeTableChecksum || table[header->volumeTableSize - 1] != '\0')
+    {
+        fprintf(stderr, "Volume table is corrupt\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const char *path = (const char *)table;
+    for (int i = 1; i <= header->numVolumes; i++)
+    {
+        if (path >= (const char *)table + header->volumeTableSize)
+        {
+            fprintf(stderr, "Volume table is corrupt\n");
+            exit(EXIT_FAILURE);
+        }
+        volumePaths[i] = ResolveVolumePath(archiveFile, path);
+        path += strlen(path) + 1;
+    }
+
+    free(table);
+    return volumePaths;
+}
+
+// Opens every volume of the archive for reading, index 0 being the archive file itself
+int *OpenVolumes(char **volumePaths, int numVolumes)
+{
+    int *volumeFds = malloc((numVolumes + 1) * sizeof(int));
+    if (volumeFds == NULL)
+    {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i <= numVolumes; i++)
+    {
+        volumeFds[i] = open(volumePaths[i], O_RDONLY);
+        if (volumeFds[i] == -1)
+        {
+            fprintf(stderr, "Failed to open volume '%s': %s\n", volumePaths[i], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    return volumeFds;
+}
+
+// Spreads the files over the volumes, biggest first onto whichever volume has the least data so far,
+// so every disk ends up with about the same amount to write. Then lays out each volume in archive order
+void AssignVolumes(ArchiveEntry *entries, int numEntries, VolumeWork *volumes, int numVolumes)
+{
+    int *order = malloc(numEntries * sizeof(int));
+    int numFiles = 0;
+    for (int i = 0; i < numEntries; i++)
+    {
+        if (entries[i].type == 'F')
+            order[numFiles++] = i;
+    }
+
+    // Simple insertion sort by descending size, this runs once over metadata that is in memory anyway
+    for (int i = 1; i < numFiles; i++)
+    {
+        int current = order[i], j = i - 1;
+        while (j >= 0 && entries[order[j]].size < entries[current].size)
+        {
+            order[j + 1] = order[j];
+            j--;
+        }
+        order[j + 1] = current;
+    }
+
+    for (int i = 0; i < numFiles; i++)
+    {
+        int lightest = 0;
+        for (int v = 1; v < numVolumes; v++)
+        {
+            if (volumes[v].volumeSize < volumes[lightest].volumeSize)
+                lightest = v;
+        }
+        entries[order[i]].volume = volumes[lightest].volume;
+        volumes[lightest].volumeSize += entries[order[i]].size;
+    }
+    free(order);
+
+    // Now that we know what goes where, give every file its offset within its volume
+    for (int v = 0; v < numVolumes; v++)
+    {
+        volumes[v].volumeSize = 0;
+    }
+    for (int i = 0; i < numEntries; i++)
+    {
+        if (entries[i].type == 'F')
+        {
+            VolumeWork *volume = &volumes[entries[i].volume - 1];
+            entries[i].offset = volume->volumeSize;
+            volume->volumeSize += entries[i].size;
+        }
+    }
+}
+
+// Thread writing the data of every file assigned to one volume
+void *WriteVolumeWorker(void *arg)
+{
+    VolumeWork *work = arg;
+
+    int volumeFd = open(work->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (volumeFd == -1)
+    {
+        fprintf(stderr, "Failed to create volume '%s': %s\n", work->path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < work->numEntries; i++)
+    {
+        // The other workers mark their own entries as dropped while we go through the list, so only the volume, which
+        // nobody changes, may be looked at before we know the entry is ours
+        ArchiveEntry *entry = &work->entries[i];
+        if (entry->volume != work->volume || entry->type != 'F')
+            continue;
+
+        // The entry name is the archived root followed by the same relative path as on disk
+        char filePath[PATH_MAX];
+        snprintf(filePath, sizeof(filePath), "%s%s", work->basePath, entry->name + work->rootLen);
+
+        // Files we cannot open or read in full are left out of the metadata, like the walk leaves out files it cannot open
+        int fileFd = open(filePath, O_RDONLY);
+        if (fileFd == -1)
+        {
+            perror("Failed to open file for reading");
+            entry->type = DROPPED_ENTRY;
+            continue;
+        }
+        if (CopyData(fileFd, 0, volumeFd, entry->offset, entry->size) != entry->size)
+        {
+            fprintf(stderr, "Failed to read all of '%s', leaving it out of the archive\n", filePath);
+            entry->type = DROPPED_ENTRY;
+        }
+        close(fileFd);
+    }
+
+    // Files left out leave a hole, which the final size turns into zeros
+    if (ftruncate(volumeFd, work->volumeSize) != 0 || (options.durable && fdatasync(volumeFd) != 0))
+    {
+        perror("Failed to finish volume");
+        exit(EXIT_FAILURE);
+    }
+    close(volumeFd);
+    return NULL;
+}
+
+// Thread extracting every file whose data is in one volume
+void *ExtractVolumeWorker(void *arg)
+{
+    VolumeWork *work = arg;
+
+    int volumeFd = open(work->path, O_RDONLY);
+    if (volumeFd == -1)
+    {
+        fprintf(stderr, "Failed to open volume '%s': %s\n", work->path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < work->numEntries; i++)
+    {
+        ArchiveEntry *entry = &work->entries[i];
+        if (entry->type != 'F' || entry->volume != work->volume)
+            continue;
+
+        char fullCDPath[PATH_MAX];
+        snprintf(fullCDPath, sizeof(fullCDPath), "%s/%s", work->basePath, entry->name);
+
+        int outFd = open(fullCDPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (outFd == -1)
+        {
+            perror("Failed to open output file for writing");
+            exit(EXIT_FAILURE);
+        }
+        if (CloneOrCopyRange(volumeFd, entry->offset, outFd, 0, entry->size, NULL) != entry->size)
+        {
+            fprintf(stderr, "Volume '%s' is missing data for '%s'\n", work->path, entry->name);
+            work->missingFiles++;
+        }
+        close(outFd);
+    }
+
+    close(volumeFd);
+    return NULL;
+}
+
+// Removes the entries marked as dropped while their data was being written, returning how many entries are left
+int RemoveDroppedEntries(ArchiveEntry *entries, int entryCount)
+{
+    int kept = 0;
+    for (int i = 0; i < entryCount; i++)
+    {
+        if (entries[i].type != DROPPED_ENTRY)
+        {
+            entries[kept++] = entries[i];
+        }
+    }
+    return kept;
+}
+
+// Runs one worker thread per volume and waits for all of them
+void RunVolumeWorkers(VolumeWork *volumes, int numVolumes, void *(*worker)(void *))
+{
+    pthread_t *threads = malloc(numVolumes * sizeof(pthread_t));
+    for (int v = 0; v < numVolumes; v++)
+    {
+        if (pthread_create(&threads[v], NULL, worker, &volumes[v]) != 0)
+        {
+            perror("Failed to start volume worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int v = 0; v < numVolumes; v++)
+    {
+        pthread_join(threads[v], NULL);
+    }
+    free(threads);
+}
+
+// Writes the data of a freshly walked tree across all the volumes in parallel, returning the volume paths to record
+char **WriteVolumes(const char *archiveFile, const char *inputPath, size_t rootLen, ArchiveEntry *entries, int *entryCount)
+{
+    int numVolumes = options.numVolumes;
+    char **volumePaths = malloc(numVolumes * sizeof(char *));
+    VolumeWork *volumes = calloc(numVolumes, sizeof(VolumeWork));
+    if (volumePaths == NULL || volumes == NULL)
+    {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int v = 0; v < numVolumes; v++)
+    {
+        volumePaths[v] = NewVolumePath(archiveFile, v + 1);
+        volumes[v].volume = v + 1;
+        volumes[v].path = ResolveVolumePath(archiveFile, volumePaths[v]);
+        volumes[v].entries = entries;
+        volumes[v].numEntries = *entryCount;
+        volumes[v].basePath = inputPath;
+        volumes[v].rootLen = rootLen;
+    }
+
+    AssignVolumes(entries, *entryCount, volumes, numVolumes);
+    RunVolumeWorkers(volumes, numVolumes, WriteVolumeWorker);
+    *entryCount = RemoveDroppedEntries(entries, *entryCount);
+
+    for (int v = 0; v < numVolumes; v++)
+    {
+        SyncParentDirectory(volumes[v].path);
+        free(volumes[v].path);
+    }
+    free(volumes);
+    return volumePaths;
+}
+
+//================================================================ DIRECT I/O ================================================================================
+// Streams data into a file through two block aligned buffers: the caller fills one while a thread of its own writes out
+// the other, so reading the data and writing it overlap even though O_DIRECT makes every write wait for the disk
+typedef struct
+{
+    int fd;
+    unsigned char *buffers[2];
+    long offsets[2];   // Where in the file each buffer goes
+    size_t lengths[2]; // How much of each buffer is data, it is written out rounded up to whole blocks
+    int full[2];       // Whether a buffer is waiting to be written
+    int current;       // The buffer the caller is filling
+    long position;     // Where in the file the buffer being filled goes
+    size_t used;       // How much of the buffer being filled is used so far
+    int done;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} DirectWriter;
+
+// Opens a file with O_DIRECT, so its data bypasses the page cache. Filesystems like tmpfs do not support it,
+// in which case the file is opened as usual
+int OpenDirect(const char *path, int flags, mode_t mode)
+{
+    int fd = open(path, flags | O_DIRECT, mode);
+    if (fd == -1 && errno == EINVAL)
+    {
+        fd = open(path, flags, mode);
+    }
+    return fd;
+}
+
+// Reserves the space of a file up front, so it is not fragmented by growing a little at a time and running out of
+// space shows up before anything is written. Filesystems without fallocate just skip this
+void PreallocateFile(int fd, long length)
+{
+    if (length > 0 && fallocate(fd, 0, 0, length) != 0 && errno != EOPNOTSUPP)
+    {
+        perror("Failed to preallocate file");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Thread writing out the buffers in the order they were filled
+void *DirectWriterThread(void *arg)
+{
+    DirectWriter *writer = arg;
+    int next = 0;
+
+    pthread_mutex_lock(&writer->lock);
+    while (1)
+    {
+        while (!writer->full[next] && !writer->done)
+        {
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        }
+        if (!writer->full[next])
+            break;
+        pthread_mutex_unlock(&writer->lock);
+
+        // O_DIRECT only writes whole blocks, anything past the data is cut off or overwritten by whoever comes next
+        size_t length = ALIGN_TO_BLOCK(writer->lengths[next]);
+        size_t written = 0;
+        while (written < length)
+        {
+            ssize_t bytesWritten = pwrite(writer->fd, writer->buffers[next] + written, length - written, writer->offsets[next] + written);
+            if (bytesWritten <= 0)
+            {
+                perror("Failed to write data");
+                exit(EXIT_FAILURE);
+            }
+            written += bytesWritten;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        writer->full[next] = 0;
+        pthread_cond_broadcast(&writer->changed);
+        next ^= 1;
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// Starts streaming into a file from the given (block aligned) offset
+DirectWriter *StartDirectWriter(int fd, long offset)
+{
+    DirectWriter *writer = calloc(1, sizeof(DirectWriter));
+    if (writer == NULL || posix_memalign((void **)&writer->buffers[0], ARCHIVE_BLOCK_SIZE, DIRECT_BUFFER_SIZE) != 0 ||
+        posix_memalign((void **)&writer->buffers[1], ARCHIVE_BLOCK_SIZE, DIRECT_BUFFER_SIZE) != 0)
+    {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    writer->fd = fd;
+    writer->position = offset;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->changed, NULL);
+    if (pthread_create(&writer->thread, NULL, DirectWriterThread, writer) != 0)
+    {
+        perror("Failed to start writer thread");
+        exit(EXIT_FAILURE);
+    }
+    return writer;
+}
+
+// Hands the buffer being filled over to the writer thread, then waits until the other buffer is free to fill
+void SubmitDirectBuffer(DirectWriter *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    writer->offsets[writer->current] = writer->position;
+    writer->lengths[writer->current] = writer->used;
+    writer->full[writer->current] = 1;
+    pthread_cond_broadcast(&writer->changed);
+
+    writer->current ^= 1;
+    while (writer->full[writer->current])
+    {
+        pthread_cond_wait(&writer->changed, &writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    writer->position += writer->used;
+    writer->used = 0;
+}
+
+// Adds the given range of another file to the stream, or zeros when inFd is -1. Returns how many bytes came from the file:
+// if it ends early or a read fails, the rest of the range is zeros so the stream stays in place, and the caller has to check
+// for the shortfall. Reads are rounded up to whole blocks so inFd can be opened with O_DIRECT too
+long FillDirect(DirectWriter *writer, int inFd, long inOffset, long length)
+{
+    long filled = 0, fromFile = 0;
+    while (filled < length)
+    {
+        unsigned char *buffer = writer->buffers[writer->current] + writer->used;
+        size_t space = DIRECT_BUFFER_SIZE - writer->used;
+        size_t chunk = (size_t)(length - filled) < space ? (size_t)(length - filled) : space;
+
+        ssize_t bytesRead = 0;
+        if (inFd != -1 && fromFile == filled)
+        {
+            size_t request = ALIGN_TO_BLOCK(chunk) < space ? ALIGN_TO_BLOCK(chunk) : space;
+            bytesRead = pread(inFd, buffer, request, inOffset + filled);
+            bytesRead = bytesRead < 0 ? 0 : ((size_t)bytesRead > chunk ? (ssize_t)chunk : bytesRead);
+            fromFile += bytesRead;
+        }
+        if (bytesRead == 0)
+        {
+            memset(buffer, 0, chunk);
+            bytesRead = chunk;
+        }
+
+        writer->used += bytesRead;
+        filled += bytesRead;
+        if (writer->used == DIRECT_BUFFER_SIZE)
+        {
+            SubmitDirectBuffer(writer);
+        }
+    }
+    return fromFile;
+}
+
+// Writes out whatever is left in the stream and stops the writer thread
+void FinishDirectWriter(DirectWriter *writer)
+{
+    if (writer->used > 0)
+    {
+        SubmitDirectBuffer(writer);
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->done = 1;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->changed);
+    free(writer->buffers[0]);
+    free(writer->buffers[1]);
+    free(writer);
+}
+
+// Gives every file of a freshly walked tree its offset in the archive file. Big files start on a block boundary
+// so they can be read back with O_DIRECT, and the data area ends on one. Returns where the data area ends
+long LayoutAligned(ArchiveEntry *entries, int entryCount)
+{
+    long offset = ARCHIVE_HEADER_SIZE;
+    for (int i = 0; i < entryCount; i++)
+    {
+        if (entries[i].type == 'F' && entries[i].size >= DIRECT_THRESHOLD)
+        {
+            offset = ALIGN_TO_BLOCK(offset);
+        }
+        entries[i].offset = offset;
+        if (entries[i].type == 'F')
+        {
+            offset += entries[i].size;
+        }
+    }
+    return ALIGN_TO_BLOCK(offset);
+}
+
+// Writes the data of a freshly walked tree in the aligned layout: the whole data area is preallocated, then streamed
+// into the archive with O_DIRECT so a big job does not push everything else out of the page cache
+void WriteDirect(const char *archiveFile, FILE *archive, const char *inputPath, size_t rootLen, ArchiveEntry *entries, int *entryCount)
+{
+    long dataEnd = LayoutAligned(entries, *entryCount);
+
+    // The header area went through stdio, it has to be out before anything else writes to the file
+    SyncArchive(archive);
+    PreallocateFile(fileno(archive), dataEnd);
+
+    int archiveFd = OpenDirect(archiveFile, O_WRONLY, 0);
+    if (archiveFd == -1)
+    {
+        perror("Failed to open archive file for writing");
+        exit(EXIT_FAILURE);
+    }
+
+    DirectWriter *writer = StartDirectWriter(archiveFd, ARCHIVE_HEADER_SIZE);
+    long position = ARCHIVE_HEADER_SIZE;
+    for (int i = 0; i < *entryCount; i++)
+    {
+        ArchiveEntry *entry = &entries[i];
+        if (entry->type != 'F')
+            continue;
+
+        // The entry name is the archived root followed by the same relative path as on disk
+        char filePath[PATH_MAX];
+        snprintf(filePath, sizeof(filePath), "%s%s", inputPath, entry->name + rootLen);
+
+        // Source files are read once, so there is no point in them taking over the page cache either
+        int fileFd = open(filePath, O_RDONLY);
+        if (fileFd != -1)
+        {
+            posix_fadvise(fileFd, 0, 0, POSIX_FADV_NOREUSE);
+        }
+
+        // The gap in front of an aligned file is zeros
+        FillDirect(writer, -1, 0, entry->offset - position);
+        position = entry->offset + entry->size;
+
+        // Files we cannot open or read in full are left out of the metadata, like the walk leaves out files it cannot open.
+        // Everything after them is already laid out, so their space stays in the archive, unused
+        if (fileFd == -1)
+        {
+            perror("Failed to open file for reading");
+            FillDirect(writer, -1, 0, entry->size);
+            entry->type = DROPPED_ENTRY;
+            continue;
+        }
+        if (FillDirect(writer, fileFd, 0, entry->size) != entry->size)
+        {
+            fprintf(stderr, "Failed to read all of '%s', leaving it out of the archive\n", filePath);
+            entry->type = DROPPED_ENTRY;
+        }
+        close(fileFd);
+    }
+    FillDirect(writer, -1, 0, dataEnd - position);
+    FinishDirectWriter(writer);
+    close(archiveFd);
+    *entryCount = RemoveDroppedEntries(entries, *entryCount);
+
+    // The metadata goes right after the data area, through stdio as usual
+    fseek(archive, dataEnd, SEEK_SET);
+}
+
+// Extracts a file laid out on a block boundary with O_DIRECT on both ends, the next part of the archive being read
+// while the previous one is written out. Returns 0 if the archive is missing some of the file's data
+int ExtractDirect(int archiveFd, const ArchiveEntry *entry, const char *outputPath)
+{
+    int outFd = OpenDirect(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (outFd == -1)
+    {
+        perror("Failed to open output file for writing");
+        exit(EXIT_FAILURE);
+    }
+    PreallocateFile(outFd, entry->size);
+
+    DirectWriter *writer = StartDirectWriter(outFd, 0);
+    int complete = FillDirect(writer, archiveFd, entry->offset, entry->size) == entry->size;
+    if (!complete)
+    {
+        fprintf(stderr, "Archive is missing data for '%s'\n", entry->name);
+    }
+    FinishDirectWriter(writer);
+
+    // The last block was written whole, cut the file back to its size
+    if (ftruncate(outFd, entry->size) != 0)
+    {
+        perror("Failed to finish output file");
+        exit(EXIT_FAILURE);
+    }
+    close(outFd);
+    return complete;
+}
+
+//================================================================ CHECKPOINTS ================================================================================
+// Name of the checkpoint file kept next to an archive while it is being created
+char *CheckpointPath(const char *archiveFile)
+{
+    char *path = malloc(strlen(archiveFile) + 6);
+    if (path == NULL)
+    {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(path, "%s.ckpt", archiveFile);
+    return path;
+}
+
+// Records how far the creation got. The data archived so far is flushed first, then a record with the data high-water mark
+// and the entries archived since the last checkpoint is added to the checkpoint file, so each entry is only written out once
+void WriteCheckpoint(FILE *archive, ArchiveEntry *entries, int entryCount)
+{
+    SyncArchive(archive);
+
+    CheckpointHeader header = {0};
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.dataEnd = ftell(archive);
+    header.numEntries = entryCount;
+    unsigned char *metadata = EncodeMetadata(ARCHIVE_VERSION, entries + checkpoint.savedCount, entryCount - checkpoint.savedCount, &header.metadataSize);
+    header.metadataChecksum = Checksum32(metadata, header.metadataSize, 0);
+    header.checksum = Checksum32(&header, offsetof(CheckpointHeader, checksum), 0);
+
+    // The records already written are never touched again. Cutting the file back to them drops a stale checkpoint on the
+    // first record of a creation, and a torn record on the first one after a resume
+    int fd = open(checkpoint.path, O_WRONLY | O_CREAT, 0666);
+    if (fd == -1 || ftruncate(fd, checkpoint.savedSize) != 0 ||
+        pwrite(fd, &header, sizeof(header), checkpoint.savedSize) != (ssize_t)sizeof(header) ||
+        pwrite(fd, metadata, header.metadataSize, checkpoint.savedSize + sizeof(header)) != header.metadataSize ||
+        (options.durable && fdatasync(fd) != 0))
+    {
+        perror("Failed to write checkpoint");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    free(metadata);
+
+    if (checkpoint.savedSize == 0)
+    {
+        SyncParentDirectory(checkpoint.path);
+    }
+
+    checkpoint.savedCount = entryCount;
+    checkpoint.savedDataEnd = header.dataEnd;
+    checkpoint.savedSize += sizeof(header) + header.metadataSize;
+}
+
+// Called by the directory walk after every entry it archives, writes a checkpoint once enough was archived since the last one
+void CheckpointProgress(FILE *archive, ArchiveEntry *entries, int entryCount)
+{
+    if (checkpoint.path == NULL)
+        return;
+
+    // With --durable every checkpoint costs two syncs, so there only the data archived triggers one. The syncs then grow
+    // with the bytes that have to reach the disk anyway, never with the number of files
+    int entriesDue = !options.durable && entryCount - checkpoint.savedCount >= CHECKPOINT_ENTRIES;
+    if (entriesDue || ftell(archive) - checkpoint.savedDataEnd >= CHECKPOINT_BYTES)
+    {
+        WriteCheckpoint(archive, entries, entryCount);
+    }
+}
+
+// Called by the directory walk before it archives an entry. If the entry was restored from the checkpoint it is already in
+// the archive, so it only gets counted and 1 is returned. The walk is sorted, so it must meet the restored entries in their order.
+// A file the interrupted run could not archive stays left out, even if it can be read by now
+int ResumedEntry(ArchiveEntry *entries, int *entryCount, const char *name, char type)
+{
+    if (*entryCount >= checkpoint.resumeCount)
+        return 0;
+
+    char restoredType = entries[*entryCount].type == DROPPED_ENTRY ? 'F' : entries[*entryCount].type;
+    if (restoredType != type || strcmp(entries[*entryCount].name, name) != 0)
+    {
+        fprintf(stderr, "'%s' does not match the checkpoint, the input has changed since and the archive cannot be resumed\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    (*entryCount)++;
+    return 1;
+}
+
+// Restores the entries and the data high-water mark of the last checkpoint, returning 0 if there is no usable checkpoint.
+// Records are read until one is torn or does not carry on from the one before it, the checkpoint is whatever came before that
+int LoadCheckpoint(FILE *archive, ArchiveEntry *entries, int *entryCount, long *dataEnd)
+{
+    FILE *file = fopen(checkpoint.path, "rb");
+    if (!file)
+        return 0;
+
+    struct stat st;
+    if (fstat(fileno(archive), &st) != 0)
+    {
+        perror("Failed to get archive file status");
+        exit(EXIT_FAILURE);
+    }
+
+    int loadedCount = 0;
+    long loadedDataEnd = ARCHIVE_HEADER_SIZE, loadedSize = 0;
+    CheckpointHeader header;
+    while (fseek(file, loadedSize, SEEK_SET) == 0 && fread(&header, sizeof(header), 1, file) == 1)
+    {
+        // The data high-water mark has to be within what actually made it into the archive
+        int valid = memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0 &&
+                    header.checksum == Checksum32(&header, offsetof(CheckpointHeader, checksum), 0) &&
+                    header.numEntries >= loadedCount && header.numEntries <= MAX_ARCHIVE_ENTRIES &&
+                    header.dataEnd >= loadedDataEnd && header.dataEnd <= st.st_size;
+
+        unsigned char *metadata = valid ? ReadMetadata(file, loadedSize + sizeof(header), header.metadataSize) : NULL;
+        valid = metadata != NULL && Checksum32(metadata, header.metadataSize, 0) == header.metadataChecksum &&
+                DecodeMetadata(ARCHIVE_VERSION, metadata, header.metadataSize, header.numEntries - loadedCount, entries + loadedCount);
+        free(metadata);
+
+        if (!valid)
+            break;
+
+        loadedCount = header.numEntries;
+        loadedDataEnd = header.dataEnd;
+        loadedSize += sizeof(header) + header.metadataSize;
+    }
+    fclose(file);
+
+    if (loadedCount == 0)
+        return 0;
+
+    *entryCount = loadedCount;
+    *dataEnd = loadedDataEnd;
+    checkpoint.savedSize = loadedSize;
+    return 1;
+}
+
+// Opens an interrupted creation to carry on where its last checkpoint left off, cutting off anything written after it.
+// Returns NULL if there is nothing to carry on with, in which case the archive is simply created from scratch
+FILE *ResumeArchive(const char *archiveFile, ArchiveEntry *entries)
+{
+    FILE *archive = fopen(archiveFile, "rb+");
+    if (!archive)
+    {
+        if (errno == ENOENT)
+            return NULL;
+        perror("Failed to open archive file");
+        exit(EXIT_FAILURE);
+    }
+
+    long dataEnd;
+    if (!LoadCheckpoint(archive, entries, &checkpoint.resumeCount, &dataEnd))
+    {
+        // Interrupted before its first checkpoint, nothing was ever committed either so we simply start over
+        ArchiveHeaderSlot header;
+        struct stat st;
+        if (fstat(fileno(archive), &st) == 0 && (st.st_size < ARCHIVE_HEADER_SIZE ||
+            (LoadArchive(archive, &header, entries) > ARCHIVE_VERSION_LEGACY && header.generation == 0)))
+        {
+            fclose(archive);
+            return NULL;
+        }
+
+        fprintf(stderr, "Archive file '%s' has no checkpoint to resume from.\n", archiveFile);
+        exit(EXIT_FAILURE);
+    }
+
+    if (ftruncate(fileno(archive), dataEnd) != 0 || fseek(archive, dataEnd, SEEK_SET) != 0)
+    {
+        perror("Failed to truncate archive file");
+        exit(EXIT_FAILURE);
+    }
+
+    checkpoint.savedCount = checkpoint.resumeCount;
+    checkpoint.savedDataEnd = dataEnd;
+    printf("Resuming after %d entries (%ld bytes)\n", checkpoint.resumeCount, dataEnd);
+    return archive;
+}
+
+//================================================================ CREATION ================================================================================
+// Function to initialize an archive
+void CreateArchive(const char *archiveFile, char *inputPath)
+{
+    CheckIfInputPathExists(inputPath);
+
+    ArchiveEntry entries[MAX_ARCHIVE_ENTRIES];
+    int entryCount = 0;
+
+    // Only a creation writing into the archive file itself as it walks is checkpointed, and that is what a resume picks up
+    if (options.numVolumes == 0 && !options.direct)
+    {
+        checkpoint.path = CheckpointPath(archiveFile);
+    }
+    FILE *archive = options.resume ? ResumeArchive(archiveFile, entries) : NULL;
+
+    if (!archive)
+    {
+        // Open the archive file as writing binary mode
+        archive = fopen(archiveFile, "wb+");
+        if (!archive)
+        {
+            perror("Failed to create archive file");
+            exit(EXIT_FAILURE);
+        }
+
+        // Reserve the header area on the archive, nothing is committed until the end. It goes out right away,
+        // so an interrupted creation leaves an archive that reads as empty rather than a file that is no archive at all
+        InitializeArchiveHeader(archive);
+        fflush(archive);
+    }
+
+    // Get information about the inputPath provided
+    struct stat path_stat;
+    stat(inputPath, &path_stat);
+
+    // Extract only the last part of the path to get the root of this archive, "dir/" must not give an empty one
+    TrimTrailingSlashes(inputPath);
+    char *rootOfArchive = strrchr(inputPath, '/');
+    if (rootOfArchive)
+    {
+        rootOfArchive++; // Skip the slash to get only the name or directory
+    }
+    else
+    {
+        rootOfArchive = inputPath; // The path does not contain any slashes
+    }
+
+    // Debug to check what the root of the archive is
+    // printf("Root of Archive: %s\n", rootOfArchive);
+
+    // When splitting into volumes or laying out the data for O_DIRECT, the walk only records the metadata and the data
+    // gets written afterwards, once we know where everything goes
+    FILE *dataArchive = (options.numVolumes > 0 || options.direct) ? NULL : archive;
+
+    // If it's a directory then we will process the directory into the archive
+    if (S_ISDIR(path_stat.st_mode))
+    {
+        processDirectory(dataArchive, inputPath, rootOfArchive, entries, &entryCount);
+    }
+
+    // Otherwise we will simply call the function to write the file directly into the archive
+    else if (!ResumedEntry(entries, &entryCount, rootOfArchive, 'F'))
+    {
+        CheckEntryRoom(entryCount);
+        if (writeFileToArchive(dataArchive, inputPath, rootOfArchive, &entries[entryCount]))
+        {
+            entryCount++;
+        }
+    }
+
+    // Restored entries the walk never came across again are gone from the input
+    if (entryCount < checkpoint.resumeCount)
+    {
+        fprintf(stderr, "Entries in the checkpoint are missing from '%s', the archive cannot be resumed\n", inputPath);
+        exit(EXIT_FAILURE);
+    }
+    entryCount = RemoveDroppedEntries(entries, entryCount);
+
+    char **volumePaths = NULL;
+    if (options.numVolumes > 0)
+    {
+        volumePaths = WriteVolumes(archiveFile, inputPath, strlen(rootOfArchive), entries, &entryCount);
+    }
+    else if (options.direct)
+    {
+        WriteDirect(archiveFile, archive, inputPath, strlen(rootOfArchive), entries, &entryCount);
+    }
+
+    // Update all header metadata at the end of the archive
+    ArchiveHeaderSlot header = {0};
+    header.numEntries = entryCount;
+    WriteArchiveMetadata(archive, ARCHIVE_VERSION, &header, entries);
+    WriteDirectorySummaries(archive, &header, entries);
+    if (volumePaths)
+    {
+        WriteVolumeTable(archive, &header, volumePaths, options.numVolumes);
+    }
+
+    // Only now that data and metadata are written do we publish the header pointing at them
+    CommitArchiveHeader(archive, ARCHIVE_VERSION, &header);
+    SyncParentDirectory(archiveFile);
+
+    // The archive is complete, so there is nothing left to resume
+    if (checkpoint.path && unlink(checkpoint.path) != 0 && errno != ENOENT)
+    {
+        perror("Failed to remove checkpoint");
+    }
+
+    fclose(archive);
+    printf("Archive created successfully\n");
+}
+
+//================================================================ APPENDING ================================================================================
+// This function will help to append a file or directory into the archive
+void AppendToArchive(const char *archiveFile, char *inputPath)
+{
+    CheckIfArchiveExists(archiveFile);
+    CheckIfInputPathExists(inputPath);
+
+    // Open the archive file in read-write mode
+    FILE *archive = fopen(archiveFile, "rb+");
+    if (!archive)
+    {
+        perror("Failed to open archive file for appending");
+        exit(EXIT_FAILURE);
+    }
+
+    // Appends wait for each other, but readers never take this lock. They keep reading the generation they
+    // loaded, since an append only adds to the end of the file and publishes through the older header slot
+    if (flock(fileno(archive), LOCK_EX) != 0)
+    {
+        perror("Failed to lock archive file for appending");
+        exit(EXIT_FAILURE);
+    }
+
+    // Read the header information and the existing metadata entries from the archive file
+    ArchiveHeaderSlot header;
+    ArchiveEntry entries[MAX_ARCHIVE_ENTRIES];
+    int version = LoadArchive(archive, &header, entries);
+    if (version == -1)
+    {
+        fclose(archive);
+        exit(EXIT_FAILURE);
+    }
+
+    // Update entry count
+    int entryCount = header.numEntries;
+
+    // Debug check to see if all entries have been read properly
+    // for(int i=0; i <entryCount; i++) {
+    //     printf("Reading in:\nName=%s\n Type=%c\n Size=%ld\n Offset=%ld\n", entries[i].name, entries[i].type, entries[i].size, entries[i].offset);
+    // }
+
+    // Move to the end of the data section to start appending
+    fseek(archive, 0, SEEK_END);
+
+    // An archive whose creation was interrupted right away does not even have its header area yet
+    if (ftell(archive) == 0)
+    {
+        InitializeArchiveHeader(archive);
+    }
+
+    // Get information about the inputPath provided
+    struct stat path_stat;
+    stat(inputPath, &path_stat);
+
+    // Extract only the last part of the path to get the root of this append, "dir/" must not give an empty one
+    TrimTrailingSlashes(inputPath);
+    char *rootOfAppendingEntity = strrchr(inputPath, '/');
+    if (rootOfAppendingEntity)
+    {
+        rootOfAppendingEntity++; // Skip the slash to get only the name or directory
+    }
+    else
+    {
+        rootOfAppendingEntity = inputPath; // The path does not contain any slashes
+    }
+
+    // Ensure the new entry name is unique
+    char uniqueName[PATH_MAX];
+    strcpy(uniqueName, rootOfAppendingEntity);
+    GenerateUniqueEntryName(entries, entryCount, uniqueName);
+
+    // If it's a directory then we will process the directory into the archive
+    if (S_ISDIR(path_stat.st_mode))
+    {
+        processDirectory(archive, inputPath, uniqueName, entries, &entryCount);
+        entryCount = RemoveDroppedEntries(entries, entryCount);
+    }
+
+    // Otherwise we will simply call the function to write the file directly into the archive
+    else
+    {
+        CheckEntryRoom(entryCount);
+        if (writeFileToArchive(archive, inputPath, uniqueName, &entries[entryCount]))
+        {
+            entryCount++;
+        }
+    }
+
+    // Update all header metadata at the end of the archive
+    header.numEntries = entryCount;
+
+    // Write the updated metadata entries, in whatever layout this archive's version uses
+    WriteArchiveMetadata(archive, version, &header, entries);
+
+    // Legacy headers have nowhere to record directory summaries
+    if (version != ARCHIVE_VERSION_LEGACY)
+    {
+        WriteDirectorySummaries(archive, &header, entries);
+    }
+
+    // Publish the new header, the previous generation stays intact until this succeeds
+    CommitArchiveHeader(archive, version, &header);
+
+    fclose(archive);
+    printf("Archive appended successfully\n");
+}
+
+//================================================================ MERGING ================================================================================
+// This function joins several archives into a new one. The data of each archive (and of each of its volumes) is
+// moved over as one range, shared with FICLONERANGE wherever the filesystem allows it, and the entry offsets are rebased onto it
+void MergeArchives(const char *archiveFile, char **inputArchives, int numInputs)
+{
+    for (int i = 0; i < numInputs; i++)
+    {
+        CheckIfArchiveExists(inputArchives[i]);
+    }
+
+    // Open the archive file as writing binary mode
+    FILE *archive = fopen(archiveFile, "wb+");
+    if (!archive)
+    {
+        perror("Failed to create archive file");
+        exit(EXIT_FAILURE);
+    }
+
+    // Reserve the header area on the archive, nothing is committed until the end
+    InitializeArchiveHeader(archive);
+    fflush(archive);
+    int archiveFd = fileno(archive);
+    long dataEnd = ARCHIVE_HEADER_SIZE;
+
+    ArchiveEntry mergedEntries[MAX_ARCHIVE_ENTRIES];
+    int mergedCount = 0;
+    long clonedBytes = 0, totalBytes = 0;
+
+    for (int i = 0; i < numInputs; i++)
+    {
+        FILE *input = fopen(inputArchives[i], "rb");
+        if (!input)
+        {
+            perror("Failed to open archive file for reading");
+            exit(EXIT_FAILURE);
+        }
+
+        ArchiveHeaderSlot header;
+        ArchiveEntry entries[MAX_ARCHIVE_ENTRIES];
+        if (LoadArchive(input, &header, entries) == -1)
+        {
+            fclose(input);
+            exit(EXIT_FAILURE);
+        }
+
+        if (mergedCount + header.numEntries > MAX_ARCHIVE_ENTRIES)
+        {
+            fprintf(stderr, "Merged archive would have more than %d entries\n", MAX_ARCHIVE_ENTRIES);
+            exit(EXIT_FAILURE);
+        }
+
+        char **volumePaths = LoadVolumeTable(input, inputArchives[i], &header);
+        int *volumeFds = OpenVolumes(volumePaths, header.numVolumes);
+
+        // Move the data of every volume over as one range, starting on a block boundary on both sides so it can be shared
+        long *rebase = calloc(header.numVolumes + 1, sizeof(long));
+        for (int v = 0; v <= header.numVolumes; v++)
+        {
+            long rangeStart = -1, rangeEnd = 0;
+            for (int j = 0; j < header.numEntries; j++)
+            {
+                if (entries[j].type != 'F' || entries[j].volume != v || entries[j].size == 0)
+                    continue;
+                if (rangeStart == -1 || entries[j].offset < rangeStart)
+                    rangeStart = entries[j].offset;
+                if (entries[j].offset + entries[j].size > rangeEnd)
+                    rangeEnd = entries[j].offset + entries[j].size;
+            }
+            if (rangeStart == -1)
+                continue;
+
+            rangeStart -= rangeStart % ARCHIVE_BLOCK_SIZE;
+            dataEnd += (ARCHIVE_BLOCK_SIZE - dataEnd % ARCHIVE_BLOCK_SIZE) % ARCHIVE_BLOCK_SIZE;
+            if (ftruncate(archiveFd, dataEnd) != 0)
+            {
+                perror("Failed to extend archive file");
+                exit(EXIT_FAILURE);
+            }
+
+            if (CloneOrCopyRange(volumeFds[v], rangeStart, archiveFd, dataEnd, rangeEnd - rangeStart, &clonedBytes) != rangeEnd - rangeStart)
+            {
+                fprintf(stderr, "Archive '%s' is missing data\n", inputArchives[i]);
+                exit(EXIT_FAILURE);
+            }
+            totalBytes += rangeEnd - rangeStart;
+            rebase[v] = dataEnd - rangeStart;
+            dataEnd += rangeEnd - rangeStart;
+        }
+
+        // Rebase the entries onto the merged data, renaming any hierarchy whose name is already taken
+        char oldRoot[PATH_MAX] = "", newRoot[PATH_MAX] = "";
+        for (int j = 0; j < header.numEntries; j++)
+        {
+            ArchiveEntry entry = entries[j];
+            size_t oldRootLen = strlen(oldRoot);
+
+            if (EntryDepth(entry.name) == 0)
+            {
+                snprintf(oldRoot, sizeof(oldRoot), "%s", entry.name);
+                snprintf(newRoot, sizeof(newRoot), "%s", entry.name);
+                GenerateUniqueEntryName(mergedEntries, mergedCount, newRoot);
+                entry.name = strdup(newRoot);
+            }
+            else if (oldRootLen > 0 && strncmp(entry.name, oldRoot, oldRootLen) == 0 && entry.name[oldRootLen] == '/')
+            {
+                char newName[PATH_MAX];
+                snprintf(newName, sizeof(newName), "%s%s", newRoot, entry.name + oldRootLen);
+                entry.name = strdup(newName);
+            }
+
+            entry.offset = (entry.type == 'F') ? entry.offset + rebase[entry.volume] : dataEnd;
+            entry.volume = 0;
+            mergedEntries[mergedCount++] = entry;
+        }
+
+        for (int v = 0; v <= header.numVolumes; v++)
+        {
+            close(volumeFds[v]);
+        }
+        free(volumeFds);
+        free(rebase);
+        fclose(input);
+    }
+
+    // The metadata goes after all the data we moved over
+    fseek(archive, dataEnd, SEEK_SET);
+
+    ArchiveHeaderSlot header = {0};
+    header.numEntries = mergedCount;
+    WriteArchiveMetadata(archive, ARCHIVE_VERSION, &header, mergedEntries);
+    WriteDirectorySummaries(archive, &header, mergedEntries);
+
+    // Only now that data and metadata are written do we publish the header pointing at them
+    CommitArchiveHeader(archive, ARCHIVE_VERSION, &header);
+    SyncParentDirectory(archiveFile);
+
+    fclose(archive);
+    printf("Archives merged successfully (%ld of %ld bytes shared instead of copied)\n", clonedBytes, totalBytes);
+}
+
+//================================================================ EXTRACTION ================================================================================
+// This function helps with the extraction of the entire hierarchy into this current directory
+void ExtractArchive(const char *archiveFile)
+{
+    CheckIfArchiveExists(archiveFile);
+
+    // Get the current working directory path
+    char basePath[PATH_MAX];
+    if (!getcwd(basePath, sizeof(basePath)))
+    {
+        perror("Failed to get current working directory");
+        return;
+    }
+
+    trimTrailingSpaces(basePath);
+
+    // Opens up the archive file in read binary mode
+    FILE *archive = fopen(archiveFile, "rb");
+    if (!archive)
+    {
+        perror("Failed to open archive file for reading");
+        exit(EXIT_FAILURE);
+    }
+
+    // Read the header information and the metadata entries from the archive file
+    ArchiveHeaderSlot header;
+    ArchiveEntry entries[MAX_ARCHIVE_ENTRIES];
+    if (LoadArchive(archive, &header, entries) == -1)
+    {
+        fclose(archive);
+        exit(EXIT_FAILURE);
+    }
+
+    // With --direct, files the archive has on a block boundary are read past the page cache
+    int directFd = options.direct ? OpenDirect(archiveFile, O_RDONLY, 0) : -1;
+    int missingFiles = 0;
+
+    // For each entry (each file entity within the archive), we will attempt to extract
+    for (int i = 0; i < header.numEntries; i++)
+    {
+        ArchiveEntry entry = entries[i];
+
+        // Append the entry to the current working directory path
+        char fullCDPath[PATH_MAX];
+
+        // Accounting for overflow in case the total full path exceeds the buffer size
+        snprintf(fullCDPath, sizeof(fullCDPath), "%s", basePath);
+        size_t remaining_size = sizeof(fullCDPath) - strlen(fullCDPath) - 1; // Minus 1 for the null terminator
+        strncat(fullCDPath, "/", remaining_size);
+        remaining_size = sizeof(fullCDPath) - strlen(fullCDPath) - 1; // Update remaining size
+        strncat(fullCDPath, entry.name, remaining_size);
+
+        // Debug to check if entries are valid
+        // printf("\nProcessing Entry: %s\nType: %c\nOffset: %ld\nSize: %ld\n",
+        //        fullCDPath, entry.type, entry.offset, entry.size);
+
+        // Create a directory in this fullpath if it doesn't exist
+        if (entry.type == 'D')
+        {
+            createDirectoryIfNotExists(fullCDPath);
+        }
+
+        if (entry.type == 'F' && entry.volume == 0 && directFd != -1 && entry.offset % ARCHIVE_BLOCK_SIZE == 0 && entry.size >= DIRECT_THRESHOLD)
+        {
+            if (!ExtractDirect(directFd, &entry, fullCDPath))
+            {
+                missingFiles++;
+            }
+        }
+
+        // Big files are moved straight from the archive into the output file within the kernel, and shared if the filesystem can
+        else if (entry.type == 'F' && entry.volume == 0 && entry.size >= CLONE_THRESHOLD)
+        {
+            int outFd = open(fullCDPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (outFd == -1)
+            {
+                perror("Failed to open output file for writing");
+                exit(EXIT_FAILURE);
+            }
+            if (CloneOrCopyRange(fileno(archive), entry.offset, outFd, 0, entry.size, NULL) != entry.size)
+            {
+                fprintf(stderr, "Archive is missing data for '%s'\n", entry.name);
+                missingFiles++;
+            }
+            close(outFd);
+        }
+
+        // Extracting files, the ones kept in volume files are extracted by a thread per volume below
+        else if (entry.type == 'F' && entry.volume == 0)
+        {
+            FILE *outFile = fopen(fullCDPath, "wb");
+            if (!outFile)
+            {
+                perror("Failed to open output file for writing");
+                exit(EXIT_FAILURE);
+            }
+
+            fseek(archive, entry.offset, SEEK_SET);
+            char buffer[1024];
+            long toRead = entry.size;
+            while (toRead > 0)
+            {
+                size_t bytesRead = fread(buffer, 1, (sizeof(buffer) < toRead ? sizeof(buffer) : toRead), archive);
+                if (bytesRead == 0)
+                {
+                    fprintf(stderr, "Archive is missing data for '%s'\n", entry.name);
+                    missingFiles++;
+                    break;
+                }
+                fwrite(buffer, 1, bytesRead, outFile);
+                toRead -= bytesRead;
+            }
+
+            fclose(outFile);
+        }
+    }
+
+    // Every directory exists by now, so all the volumes can be read at the same time
+    if (header.numVolumes > 0)
+    {
+        char **volumePaths = LoadVolumeTable(archive, archiveFile, &header);
+        VolumeWork *volumes = calloc(header.numVolumes, sizeof(VolumeWork));
+        if (volumes == NULL)
+        {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int v = 0; v < header.numVolumes; v++)
+        {
+            volumes[v].volume = v + 1;
+            volumes[v].path = volumePaths[v + 1];
+            volumes[v].entries = entries;
+            volumes[v].numEntries = header.numEntries;
+            volumes[v].basePath = basePath;
+        }
+        RunVolumeWorkers(volumes, header.numVolumes, ExtractVolumeWorker);
+        for (int v = 0; v < header.numVolumes; v++)
+        {
+            missingFiles += volumes[v].missingFiles;
+        }
+        free(volumes);
+    }
+
+    if (directFd != -1)
+    {
+        close(directFd);
+    }
+    fclose(archive);
+
+    // Everything that could be extracted was, but files that came out short must not pass for a good extraction
+    if (missingFiles > 0)
+    {
+        fprintf(stderr, "Extraction incomplete: %d file(s) are missing data in the archive\n", missingFiles);
+        exit(EXIT_FAILURE);
+    }
+    printf("Extraction completed successfully\n");
+}
+
+//================================================================ METADATA ================================================================================
+// This function will print out all relevant metadata information regarding the file/directory
+void PrintMetaData(const char *archiveFile)
+{
+    CheckIfArchiveExists(archiveFile);
+
+    // Open the archive file in read mode
+    FILE *archive = fopen(archiveFile, "rb");
+    if (!archive)
+    {
+        perror("Failed to open archive file for reading");
+        exit(EXIT_FAILURE);
+    }
+
+    // Read the header information and the metadata entries from the archive file
+    ArchiveHeaderSlot header;
+    ArchiveEntry entries[MAX_ARCHIVE_ENTRIES];
+    if (LoadArchive(archive, &header, entries) == -1)
+    {
+        fclose(archive);
+        exit(EXIT_FAILURE);
+    }
+
+    // // Debug check to see if all entries have been read properly
+    // for(int i=0; i <header.numEntries; i++) {
+    //     printf("Reading in:\nName=%s\n Type=%c\n Size=%ld\n Offset=%ld\n", entries[i].name, entries[i].type, entries[i].size, entries[i].offset);
     // }
 
-    // Move to the end of the data section to start appending
-    fseek(archive, 0, SEEK_END);
+    printf("Metadata information for each File/Directory:\n");
+    if (header.generation > 0)
+    {
+        printf("(Archive generation %lu)\n", header.generation);
+    }
+    printf("---------------------------------------------\n");
+    // Print metadata for each entry
+    for (int i = 0; i < header.numEntries; i++)
+    {
+        ArchiveEntry entry = entries[i];
+
+        // Get owner and group information
+        struct passwd *pwd = getpwuid(entry.owner);
+        struct group *grp = getgrgid(entry.group);
+
+        // Get permissions string
+        char permStr[11];
+        getPermissionsString(entry.rights, permStr);
+
+        // Print metadata information
+        printf("Name: %s\n", entry.name);
+        printf("Type: %c\n", entry.type);
+        printf("Owner: %s\n", pwd ? pwd->pw_name : "Unknown");
+        printf("Group: %s\n", grp ? grp->gr_name : "Unknown");
+        printf("Permissions: %s\n", permStr);
+        printf("Size: %ld bytes\n", entry.size);
+        printf("Offset: %ld\n", entry.offset);
+        if (entry.volume > 0)
+        {
+            printf("Volume: %d\n", entry.volume);
+        }
+        printf("-------------------------\n");
+    }
+
+    fclose(archive);
+}
+
+//================================================================ DISPLAY ================================================================================
+// This function will display the hierarchy(-ies) within the archive file
+void DisplayArchive(const char *archiveFile)
+{
+    CheckIfArchiveExists(archiveFile);
+
+    // Open the archive file in read mode
+    FILE *archive = fopen(archiveFile, "rb");
+    if (!archive)
+    {
+        perror("Failed to open archive file for reading");
+        exit(EXIT_FAILURE);
+    }
+
+    // Read the header information and the metadata entries from the archive file
+    ArchiveHeaderSlot header;
+    ArchiveEntry entries[MAX_ARCHIVE_ENTRIES];
+    if (LoadArchive(archive, &header, entries) == -1)
+    {
+        fclose(archive);
+        exit(EXIT_FAILURE);
+    }
+
+    fclose(archive);
+
+    // Display the hierarchy
+    printf("Archived Hierarchy(-ies):\n");
+    printf("--------------------------------");
+    DisplayHierarchy(entries, header.numEntries, 0, "");
+}
+
+//================================================================ TAR STREAMS ================================================================================
+#define TAR_BLOCK_SIZE 512
+
+// Long names and pax headers are read into memory whole, so the stream does not get to pick their size. Real ones are a few
+// hundred bytes, this is far more than any path needs
+#define TAR_EXTENDED_HEADER_MAX (1024 * 1024)
+
+// Layout of a POSIX ustar header block
+typedef struct
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+} TarHeader;
+
+// Reads a numeric header field, which is octal text or, for values too big for that, GNU base-256
+unsigned long ParseTarNumber(const char *field, size_t length)
+{
+    unsigned long value = 0;
+
+    if ((unsigned char)field[0] & 0x80)
+    {
+        value = (unsigned char)field[0] & 0x3F;
+        for (size_t i = 1; i < length; i++)
+        {
+            value = (value << 8) | (unsigned char)field[i];
+        }
+        return value;
+    }
+
+    for (size_t i = 0; i < length && field[i] != '\0'; i++)
+    {
+        if (field[i] >= '0' && field[i] <= '7')
+            value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+// Writes a numeric header field as octal text, falling back to GNU base-256 when it does not fit
+void FormatTarNumber(char *field, size_t length, unsigned long value)
+{
+    if (value >> (3 * (length - 1)) == 0)
+    {
+        snprintf(field, length, "%0*lo", (int)(length - 1), value);
+        return;
+    }
+
+    memset(field, 0, length);
+    for (size_t i = length - 1; i > 0; i--)
+    {
+        field[i] = (char)(value & 0xFF);
+        value >>= 8;
+    }
+    field[0] = (char)0x80;
+}
+
+// The header checksum is the sum of all its bytes, counting the checksum field itself as spaces
+unsigned long TarChecksum(const TarHeader *header)
+{
+    const unsigned char *bytes = (const unsigned char *)header;
+    unsigned long sum = 0;
+    for (size_t i = 0; i < sizeof(TarHeader); i++)
+    {
+        if (i >= offsetof(TarHeader, checksum) && i < offsetof(TarHeader, checksum) + sizeof(header->checksum))
+            sum += ' ';
+        else
+            sum += bytes[i];
+    }
+    return sum;
+}
+
+// Number of padding bytes that bring a member's data up to a whole block
+long TarPadding(long size)
+{
+    return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+// Reads and throws away bytes of the stream, which may well be a pipe we cannot seek on
+void SkipTarData(FILE *in, long length)
+{
+    char buffer[TAR_BLOCK_SIZE];
+    while (length > 0)
+    {
+        size_t chunk = length < (long)sizeof(buffer) ? (size_t)length : sizeof(buffer);
+        if (fread(buffer, 1, chunk, in) != chunk)
+        {
+            fprintf(stderr, "Tar stream ended unexpectedly\n");
+            exit(EXIT_FAILURE);
+        }
+        length -= chunk;
+    }
+}
+
+// Reads the data of a GNU long name or pax header member as a string
+char *ReadTarString(FILE *in, long size)
+{
+    if (size > TAR_EXTENDED_HEADER_MAX)
+    {
+        fprintf(stderr, "Tar stream has an extended header of %ld bytes, more than the %d allowed\n", size, TAR_EXTENDED_HEADER_MAX);
+        exit(EXIT_FAILURE);
+    }
+
+    char *text = malloc(size + 1);
+    if (text == NULL)
+    {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    if (fread(text, 1, size, in) != (size_t)size)
+    {
+        fprintf(stderr, "Tar stream ended unexpectedly\n");
+        exit(EXIT_FAILURE);
+    }
+    text[size] = '\0';
+    SkipTarData(in, TarPadding(size));
+    return text;
+}
+
+// Picks the path and size out of the "length key=value\n" records of a pax extended header. They are left alone
+// when the header has none. Returns 0 if a record does not fit in the header or is not laid out like one
+int ParsePaxRecords(const char *records, long recordsSize, char **path, long *size)
+{
+    const char *record = records, *end = records + recordsSize;
+    while (record < end)
+    {
+        // The length counts the whole record, from its own digits to the closing newline
+        long length = 0;
+        const char *keyStart = record;
+        while (keyStart < end && *keyStart >= '0' && *keyStart <= '9' && length <= recordsSize)
+        {
+            length = length * 10 + (*keyStart++ - '0');
+        }
+        if (keyStart == record || keyStart >= end || *keyStart != ' ' || length <= keyStart + 1 - record ||
+            length > end - record || record[length - 1] != '\n')
+            return 0;
+        keyStart++;
+
+        const char *recordEnd = record + length - 1;
+        const char *equals = memchr(keyStart, '=', recordEnd - keyStart);
+        if (equals == NULL)
+            return 0;
+
+        const char *value = equals + 1;
+        if (equals - keyStart == 4 && strncmp(keyStart, "path", 4) == 0)
+        {
+            free(*path);
+            *path = strndup(value, recordEnd - value);
+        }
+        else if (equals - keyStart == 4 && strncmp(keyStart, "size", 4) == 0)
+        {
+            char *sizeEnd;
+            *size = strtol(value, &sizeEnd, 10);
+            if (sizeEnd != recordEnd || value == recordEnd || *size < 0)
+                return 0;
+        }
+        record += length;
+    }
+    return 1;
+}
 
-    // Get information about the inputPath provided
-    struct stat path_stat;
-    stat(inputPath, &path_stat);
+// Tar member names may come with "./" or "/" in front, "/" at the end and "//" or "/./" in between, none of which belong
+// in an entry name. Returns 0 for a name with a ".." in it, since extracting it could write outside the extraction
+// directory. Like GNU tar, such members are skipped
+int NormalizeTarName(char *name)
+{
+    char *out = name;
+    const char *component = name;
+    while (*component)
+    {
+        const char *slashPos = strchr(component, '/');
+        size_t length = slashPos ? (size_t)(slashPos - component) : strlen(component);
 
-    // Extract only the last part of the path to get the root of this append
-    char *rootOfAppendingEntity = strrchr(inputPath, '/');
-    if (rootOfAppendingEntity)
+        if (length == 2 && strncmp(component, "..", 2) == 0)
+            return 0;
+
+        // Empty and "." components add nothing to the path
+        if (length > 0 && !(length == 1 && component[0] == '.'))
+        {
+            if (out != name)
+            {
+                *out++ = '/';
+            }
+            memmove(out, component, length);
+            out += length;
+        }
+        component += slashPos ? length + 1 : length;
+    }
+    *out = '\0';
+    return 1;
+}
+
+// Finds an entry by name while importing, -1 if there is none yet
+int FindImportedEntry(ArchiveEntry *entries, int entryCount, const char *name)
+{
+    for (int i = 0; i < entryCount; i++)
+    {
+        if (strcmp(entries[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Returns the entry a tar member should be recorded in: the existing one if the stream repeats a path
+// (the last one wins, like with tar), otherwise a new one
+ArchiveEntry *ImportedEntry(ArchiveEntry *entries, int *entryCount, const char *name)
+{
+    int index = FindImportedEntry(entries, *entryCount, name);
+    if (index != -1)
+    {
+        free(entries[index].name);
+    }
+    else
+    {
+        if (*entryCount == MAX_ARCHIVE_ENTRIES)
+        {
+            fprintf(stderr, "Tar stream has more than %d entries\n", MAX_ARCHIVE_ENTRIES);
+            exit(EXIT_FAILURE);
+        }
+        index = (*entryCount)++;
+    }
+
+    memset(&entries[index], 0, sizeof(ArchiveEntry));
+    entries[index].name = strdup(name);
+    return &entries[index];
+}
+
+// Tar streams do not always contain the parent directories of their members, but extraction needs them
+void AddMissingParents(ArchiveEntry *entries, int *entryCount, const char *name, long offset)
+{
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", name);
+
+    for (char *slashPos = strchr(parent, '/'); slashPos; slashPos = strchr(slashPos + 1, '/'))
+    {
+        *slashPos = '\0';
+        if (FindImportedEntry(entries, *entryCount, parent) == -1)
+        {
+            ArchiveEntry *dirEntry = ImportedEntry(entries, entryCount, parent);
+            dirEntry->type = 'D';
+            dirEntry->offset = offset;
+            dirEntry->owner = getuid();
+            dirEntry->group = getgid();
+            dirEntry->rights = S_IFDIR | 0755;
+        }
+        *slashPos = '/';
+    }
+}
+
+// Orders entry names so that every directory comes right before everything inside of it, like a directory walk does
+int CompareEntryPaths(const void *a, const void *b)
+{
+    const unsigned char *nameA = (const unsigned char *)((const ArchiveEntry *)a)->name;
+    const unsigned char *nameB = (const unsigned char *)((const ArchiveEntry *)b)->name;
+
+    while (*nameA && *nameA == *nameB)
+    {
+        nameA++;
+        nameB++;
+    }
+
+    // A '/' sorts before any other character so "dir/file" comes before "dir-2"
+    int charA = (*nameA == '/') ? 1 : (*nameA == '\0' ? 0 : *nameA + 1);
+    int charB = (*nameB == '/') ? 1 : (*nameB == '\0' ? 0 : *nameB + 1);
+    return charA - charB;
+}
+
+// This function converts a tar stream (stdin for "-") straight into a new archive in a single pass.
+// Data is copied into the archive as it streams by, so only the metadata is ever held in memory
+void ImportTar(const char *archiveFile, const char *inputPath)
+{
+    FILE *in = stdin;
+    if (strcmp(inputPath, "-") != 0)
+    {
+        CheckIfInputPathExists(inputPath);
+        in = fopen(inputPath, "rb");
+        if (!in)
+        {
+            perror("Failed to open tar file for reading");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Open the archive file as writing binary mode
+    FILE *archive = fopen(archiveFile, "wb+");
+    if (!archive)
+    {
+        perror("Failed to create archive file");
+        exit(EXIT_FAILURE);
+    }
+
+    // Reserve the header area on the archive, nothing is committed until the end
+    InitializeArchiveHeader(archive);
+
+    ArchiveEntry entries[MAX_ARCHIVE_ENTRIES];
+    int entryCount = 0;
+
+    // Names carried by a GNU long name or pax header apply to the member right after them, and so does a pax size
+    char *longName = NULL;
+    long paxSize = -1;
+
+    TarHeader block;
+    while (fread(&block, sizeof(TarHeader), 1, in) == 1)
+    {
+        // An all zero block marks the end of the archive
+        static const TarHeader endBlock;
+        if (memcmp(&block, &endBlock, sizeof(TarHeader)) == 0)
+            break;
+
+        if (ParseTarNumber(block.checksum, sizeof(block.checksum)) != TarChecksum(&block))
+        {
+            fprintf(stderr, "Input is not a valid tar stream\n");
+            exit(EXIT_FAILURE);
+        }
+
+        long size = ParseTarNumber(block.size, sizeof(block.size));
+        if (size < 0)
+        {
+            fprintf(stderr, "Input is not a valid tar stream\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // Extended headers describing the next member
+        if (block.typeflag == 'L')
+        {
+            free(longName);
+            longName = ReadTarString(in, size);
+            continue;
+        }
+        if (block.typeflag == 'x' || block.typeflag == 'g')
+        {
+            char *records = ReadTarString(in, size);
+            char *paxPath = NULL;
+            long recordSize = -1;
+            if (!ParsePaxRecords(records, size, &paxPath, &recordSize))
+            {
+                fprintf(stderr, "Tar stream has a malformed pax header\n");
+                exit(EXIT_FAILURE);
+            }
+            free(records);
+
+            // Only the extended header of the next member applies, a global one has no business setting these
+            if (block.typeflag == 'x' && paxPath)
+            {
+                free(longName);
+                longName = paxPath;
+            }
+            else
+            {
+                free(paxPath);
+            }
+            if (block.typeflag == 'x' && recordSize != -1)
+            {
+                paxSize = recordSize;
+            }
+            continue;
+        }
+
+        // Sizes too big for the header (8 GiB and up) come from the pax header
+        if (paxSize != -1)
+        {
+            size = paxSize;
+            paxSize = -1;
+        }
+
+        // Otherwise the name is the ustar prefix and name put together, unless an extended header overrode it
+        char name[PATH_MAX];
+        if (longName)
+        {
+            snprintf(name, sizeof(name), "%s", longName);
+            free(longName);
+            longName = NULL;
+        }
+        else if (strncmp(block.magic, "ustar", 5) == 0 && block.prefix[0] != '\0')
+        {
+            snprintf(name, sizeof(name), "%.*s/%.*s", (int)sizeof(block.prefix), block.prefix, (int)sizeof(block.name), block.name);
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "%.*s", (int)sizeof(block.name), block.name);
+        }
+        if (!NormalizeTarName(name))
+        {
+            fprintf(stderr, "Skipping '%s': member names containing '..' are not archived\n", name);
+            SkipTarData(in, size + TarPadding(size));
+            continue;
+        }
+
+        int isFile = block.typeflag == '0' || block.typeflag == '\0' || block.typeflag == '7';
+        int isDirectory = block.typeflag == '5';
+        if (name[0] == '\0' || (!isFile && !isDirectory))
+        {
+            if (name[0] != '\0')
+            {
+                fprintf(stderr, "Skipping '%s': only files and directories can be archived\n", name);
+            }
+            SkipTarData(in, size + TarPadding(size));
+            continue;
+        }
+
+        long offset = ftell(archive);
+        AddMissingParents(entries, &entryCount, name, offset);
+
+        ArchiveEntry *entry = ImportedEntry(entries, &entryCount, name);
+        entry->type = isDirectory ? 'D' : 'F';
+        entry->offset = offset;
+        entry->owner = ParseTarNumber(block.uid, sizeof(block.uid));
+        entry->group = ParseTarNumber(block.gid, sizeof(block.gid));
+        entry->rights = (ParseTarNumber(block.mode, sizeof(block.mode)) & 07777) | (isDirectory ? S_IFDIR : S_IFREG);
+
+        if (isDirectory)
+        {
+            SkipTarData(in, size + TarPadding(size));
+            continue;
+        }
+
+        // Stream the member's data straight into the data area
+        char buffer[65536];
+        long remaining = size;
+        while (remaining > 0)
+        {
+            size_t chunk = remaining < (long)sizeof(buffer) ? (size_t)remaining : sizeof(buffer);
+            if (fread(buffer, 1, chunk, in) != chunk)
+            {
+                fprintf(stderr, "Tar stream ended unexpectedly\n");
+                exit(EXIT_FAILURE);
+            }
+            fwrite(buffer, 1, chunk, archive);
+            remaining -= chunk;
+        }
+        entry->size = size;
+        SkipTarData(in, TarPadding(size));
+    }
+    free(longName);
+
+    if (in != stdin)
+    {
+        fclose(in);
+    }
+
+    // Tar streams can list members in any order, so put every directory in front of its contents
+    qsort(entries, entryCount, sizeof(ArchiveEntry), CompareEntryPaths);
+
+    // Update all header metadata at the end of the archive
+    ArchiveHeaderSlot header = {0};
+    header.numEntries = entryCount;
+    WriteArchiveMetadata(archive, ARCHIVE_VERSION, &header, entries);
+    WriteDirectorySummaries(archive, &header, entries);
+
+    // Only now that data and metadata are written do we publish the header pointing at them
+    CommitArchiveHeader(archive, ARCHIVE_VERSION, &header);
+    SyncParentDirectory(archiveFile);
+
+    fclose(archive);
+    printf("Archive imported successfully\n");
+}
+
+// Writes a whole buffer to the output, which may be a pipe taking it in pieces
+void WriteAll(int fd, const void *data, size_t length)
+{
+    const char *bytes = data;
+    while (length > 0)
+    {
+        ssize_t written = write(fd, bytes, length);
+        if (written <= 0)
+        {
+            perror("Failed to write tar stream");
+            exit(EXIT_FAILURE);
+        }
+        bytes += written;
+        length -= written;
+    }
+}
+
+// Streams a range of the archive to the output with sendfile, so the data never passes through user space.
+// Outputs that sendfile cannot handle get it copied the ordinary way, and an archive missing data is an error
+void SendData(int outFd, int inFd, long offset, long length)
+{
+    off_t position = offset;
+    long remaining = length;
+    while (remaining > 0)
+    {
+        ssize_t sent = sendfile(outFd, inFd, &position, remaining);
+        if (sent <= 0)
+            break;
+        remaining -= sent;
+    }
+
+    char buffer[65536];
+    while (remaining > 0)
+    {
+        size_t chunk = remaining < (long)sizeof(buffer) ? (size_t)remaining : sizeof(buffer);
+        ssize_t bytesRead = pread(inFd, buffer, chunk, position);
+        if (bytesRead < 0)
+        {
+            perror("Failed to read archive data");
+            exit(EXIT_FAILURE);
+        }
+        if (bytesRead == 0)
+        {
+            fprintf(stderr, "Archive data ends at %ld, before the %ld bytes at %ld it should have\n", (long)position, length, offset);
+            exit(EXIT_FAILURE);
+        }
+        WriteAll(outFd, buffer, bytesRead);
+        position += bytesRead;
+        remaining -= bytesRead;
+    }
+}
+
+// Writes the header block(s) of one entry. Names too long for ustar are preceded by a GNU long name member
+void WriteTarHeader(int outFd, const ArchiveEntry *entry, time_t mtime)
+{
+    char name[PATH_MAX + 2];
+    snprintf(name, sizeof(name), "%s%s", entry->name, entry->type == 'D' ? "/" : "");
+    size_t nameLen = strlen(name);
+
+    TarHeader header;
+    memset(&header, 0, sizeof(TarHeader));
+
+    // Short names fit as they are, longer ones can be split into the prefix and name fields at a '/'
+    const char *splitPos = NULL;
+    if (nameLen > sizeof(header.name))
+    {
+        for (const char *c = name + nameLen - 1; c > name; c--)
+        {
+            if (*c == '/' && c != name + nameLen - 1 && (size_t)(c - name) <= sizeof(header.prefix) && nameLen - (c - name) - 1 <= sizeof(header.name))
+            {
+                splitPos = c;
+                break;
+            }
+        }
+
+        if (!splitPos)
+        {
+            TarHeader longLink;
+            memset(&longLink, 0, sizeof(TarHeader));
+            strcpy(longLink.name, "././@LongLink");
+            FormatTarNumber(longLink.mode, sizeof(longLink.mode), 0644);
+            FormatTarNumber(longLink.uid, sizeof(longLink.uid), 0);
+            FormatTarNumber(longLink.gid, sizeof(longLink.gid), 0);
+            FormatTarNumber(longLink.size, sizeof(longLink.size), nameLen + 1);
+            FormatTarNumber(longLink.mtime, sizeof(longLink.mtime), 0);
+            longLink.typeflag = 'L';
+            memcpy(longLink.magic, "ustar ", 6);
+            memcpy(longLink.version, " ", 2);
+            FormatTarNumber(longLink.checksum, 7, TarChecksum(&longLink));
+            longLink.checksum[7] = ' ';
+
+            char padding[TAR_BLOCK_SIZE] = {0};
+            WriteAll(outFd, &longLink, sizeof(TarHeader));
+            WriteAll(outFd, name, nameLen + 1);
+            WriteAll(outFd, padding, TarPadding(nameLen + 1));
+        }
+    }
+
+    if (splitPos)
+    {
+        memcpy(header.prefix, name, splitPos - name);
+        memcpy(header.name, splitPos + 1, nameLen - (splitPos - name) - 1);
+    }
+    else
+    {
+        memcpy(header.name, name, nameLen < sizeof(header.name) ? nameLen : sizeof(header.name));
+    }
+
+    struct passwd *pwd = getpwuid(entry->owner);
+    struct group *grp = getgrgid(entry->group);
+
+    FormatTarNumber(header.mode, sizeof(header.mode), entry->rights & 07777);
+    FormatTarNumber(header.uid, sizeof(header.uid), entry->owner);
+    FormatTarNumber(header.gid, sizeof(header.gid), entry->group);
+    FormatTarNumber(header.size, sizeof(header.size), entry->type == 'F' ? entry->size : 0);
+    FormatTarNumber(header.mtime, sizeof(header.mtime), mtime);
+    header.typeflag = entry->type == 'D' ? '5' : '0';
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+    snprintf(header.uname, sizeof(header.uname), "%s", pwd ? pwd->pw_name : "");
+    snprintf(header.gname, sizeof(header.gname), "%s", grp ? grp->gr_name : "");
+    FormatTarNumber(header.checksum, 7, TarChecksum(&header));
+    header.checksum[7] = ' ';
+
+    WriteAll(outFd, &header, sizeof(TarHeader));
+}
+
+// This function writes the archive out as a tar stream (stdout for "-") in a single pass, without extracting anything
+void ExportTar(const char *archiveFile, const char *outputPath)
+{
+    CheckIfArchiveExists(archiveFile);
+
+    // Open the archive file in read mode
+    FILE *archive = fopen(archiveFile, "rb");
+    if (!archive)
+    {
+        perror("Failed to open archive file for reading");
+        exit(EXIT_FAILURE);
+    }
+
+    // Read the header information and the metadata entries from the archive file
+    ArchiveHeaderSlot header;
+    ArchiveEntry entries[MAX_ARCHIVE_ENTRIES];
+    if (LoadArchive(archive, &header, entries) == -1)
+    {
+        fclose(archive);
+        exit(EXIT_FAILURE);
+    }
+
+    char **volumePaths = LoadVolumeTable(archive, archiveFile, &header);
+    int *volumeFds = OpenVolumes(volumePaths, header.numVolumes);
+
+    int outFd = STDOUT_FILENO;
+    if (strcmp(outputPath, "-") != 0)
+    {
+        outFd = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outFd == -1)
+        {
+            perror("Failed to create tar file");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (isatty(outFd))
+    {
+        fprintf(stderr, "Refusing to write a tar stream to a terminal\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Entries have no modification time of their own, so they all get the archive's
+    struct stat st;
+    fstat(fileno(archive), &st);
+
+    char padding[TAR_BLOCK_SIZE] = {0};
+    for (int i = 0; i < header.numEntries; i++)
+    {
+        WriteTarHeader(outFd, &entries[i], st.st_mtime);
+
+        if (entries[i].type == 'F')
+        {
+            SendData(outFd, volumeFds[entries[i].volume], entries[i].offset, entries[i].size);
+            WriteAll(outFd, padding, TarPadding(entries[i].size));
+        }
+    }
+
+    // Two zero blocks end a tar archive
+    WriteAll(outFd, padding, sizeof(padding));
+    WriteAll(outFd, padding, sizeof(padding));
+
+    if (outFd != STDOUT_FILENO)
+    {
+        close(outFd);
+    }
+    for (int v = 0; v <= header.numVolumes; v++)
+    {
+        close(volumeFds[v]);
+    }
+    free(volumeFds);
+    fclose(archive);
+}
+
+//================================================================ DISK USAGE ================================================================================
+// This function prints how much data every directory at or below the given archived path holds, du style.
+// Only the header slot, the directory summaries and their names are read, never the data area nor the metadata.
+// Archives written before the summaries had names, or questions about a single file, need the metadata after all
+void PrintDiskUsage(const char *archiveFile, const char *subtree)
+{
+    CheckIfArchiveExists(archiveFile);
+
+    // Open the archive file in read mode
+    FILE *archive = fopen(archiveFile, "rb");
+    if (!archive)
+    {
+        perror("Failed to open archive file for reading");
+        exit(EXIT_FAILURE);
+    }
+
+    DirectorySummary summaries[MAX_ARCHIVE_ENTRIES];
+    char *names[MAX_ARCHIVE_ENTRIES];
+    int numSummaries = LoadSummaryIndex(archive, summaries, names);
+
+    // Without the names, the directories have to be looked up in the metadata
+    ArchiveHeaderSlot header;
+    ArchiveEntry entries[MAX_ARCHIVE_ENTRIES];
+    int loaded = 0;
+    if (numSummaries == -1)
     {
-        rootOfAppendingEntity++; // Skip the slash to get only the name or directory
+        if (LoadArchive(archive, &header, entries) == -1)
+        {
+            fclose(archive);
+            exit(EXIT_FAILURE);
+        }
+        loaded = 1;
+
+        numSummaries = LoadDirectorySummaries(archive, &header, entries, summaries);
+        for (int i = 0; i < numSummaries; i++)
+        {
+            names[i] = entries[summaries[i].entryIndex].name;
+        }
     }
-    else
+
+    // "." asks for every hierarchy in the archive, anything else names an archived path
+    int everything = strcmp(subtree, ".") == 0;
+    size_t subtreeLen = strlen(subtree);
+    while (!everything && subtreeLen > 1 && subtree[subtreeLen - 1] == '/')
     {
-        rootOfAppendingEntity = inputPath; // The path does not contain any slashes
+        subtreeLen--; // Ignore trailing slashes so "dir/" and "dir" are the same thing
     }
 
-    // Ensure the new entry name is unique
-    char uniqueName[256];
-    strcpy(uniqueName, rootOfAppendingEntity);
-    GenerateUniqueEntryName(entries, entryCount, uniqueName);
+    printf("Disk usage of each directory:\n");
+    printf("--------------------------------\n");
 
-    // If it's a directory then we will process the directory into the archive
-    if (S_ISDIR(path_stat.st_mode))
+    int found = 0;
+    for (int i = 0; i < numSummaries; i++)
     {
-        processDirectory(archive, inputPath, uniqueName, entries, &entryCount);
+        const char *name = names[i];
+        if (everything || (strncmp(name, subtree, subtreeLen) == 0 && (name[subtreeLen] == '\0' || name[subtreeLen] == '/')))
+        {
+            printf("%12ld bytes %8d files %4d levels   %s\n", summaries[i].totalBytes, summaries[i].fileCount, summaries[i].maxDepth, name);
+            found = 1;
+        }
     }
 
-    // Otherwise we will simply call the function to write the file directly into the archive
-    else
+    // A single archived file is its own answer, that one we can only find in the metadata
+    if (!found && !everything && !loaded)
     {
-        writeFileToArchive(archive, inputPath, uniqueName, &entries[entryCount]);
-        entryCount++;
+        if (LoadArchive(archive, &header, entries) == -1)
+        {
+            fclose(archive);
+            exit(EXIT_FAILURE);
+        }
+        loaded = 1;
     }
+    fclose(archive);
 
-    // Update all header metadata at the end of the archive
-    long newMetadataOffset = ftell(archive);
-    header.metadataOffset = newMetadataOffset;
-    header.numEntries = entryCount;
-
-    // Write the updated metadata entries
-    if (fwrite(entries, sizeof(ArchiveEntry), entryCount, archive) != entryCount)
+    for (int i = 0; !found && loaded && i < header.numEntries; i++)
     {
-        perror("Failed to write updated metadata entries");
-        fclose(archive);
-        exit(EXIT_FAILURE);
+        if (entries[i].type == 'F' && strlen(entries[i].name) == subtreeLen && strncmp(entries[i].name, subtree, subtreeLen) == 0)
+        {
+            printf("%12ld bytes %8d files %4d levels   %s\n", entries[i].size, 1, 0, entries[i].name);
+            found = 1;
+        }
     }
 
-    // Go back to the beginning and update the header
-    rewind(archive);
-    if (fwrite(&header, sizeof(ArchiveHeader), 1, archive) != 1)
+    if (!found && !everything)
     {
-        perror("Failed to update archive header");
-        fclose(archive);
+        fprintf(stderr, "'%s' is not in the archive\n", subtree);
         exit(EXIT_FAILURE);
     }
-
-    fclose(archive);
-    printf("Archive appended successfully\n");
 }
 
-//================================================================ EXTRACTION ================================================================================
-// This function helps with the extraction of the entire hierarchy into this current directory
-void ExtractArchive(const char *archiveFile)
+//================================================================ DIFF ================================================================================
+// A directory of the live tree waiting to be compared, along with the name it would have inside the archive
+typedef struct DiffWork
 {
-    CheckIfArchiveExists(archiveFile);
+    char *livePath;
+    char *archiveName;
+    struct DiffWork *next;
+} DiffWork;
 
-    // Get the current working directory path
-    char basePath[PATH_MAX];
-    if (!getcwd(basePath, sizeof(basePath)))
+// A single added ('+'), removed ('-') or changed ('~') path found by the diff
+typedef struct
+{
+    char kind;
+    char *name;
+} DiffResult;
+
+// State shared by all the diff worker threads
+typedef struct
+{
+    ArchiveEntry *entries;
+    int numEntries;
+    int *hashIndex;  // Open addressing table of entry index + 1, 0 marks an empty bucket
+    int hashSize;    // Always a power of two
+    char *seen;      // Which entries were matched by a live path
+    int *volumeFds;  // The archive file and its volumes, shared by all workers and only ever read with pread
+    pthread_mutex_t lock;
+    pthread_cond_t workAvailable;
+    DiffWork *queue;
+    int pendingWork; // Directories queued or being compared right now
+    DiffResult *results;
+    int numResults;
+    int resultCapacity;
+} DiffContext;
+
+// FNV-1a hash of an entry name
+unsigned int HashName(const char *name)
+{
+    unsigned int hash = 2166136261u;
+    while (*name)
     {
-        perror("Failed to get current working directory");
-        return;
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
     }
+    return hash;
+}
 
-    trimTrailingSpaces(basePath);
+// Builds the name -> entry hash index so every live path is matched in constant time
+void BuildDiffIndex(DiffContext *ctx)
+{
+    ctx->hashSize = 16;
+    while (ctx->hashSize < ctx->numEntries * 2)
+    {
+        ctx->hashSize *= 2;
+    }
 
-    // Opens up the archive file in read binary mode
-    FILE *archive = fopen(archiveFile, "rb");
-    if (!archive)
+    ctx->hashIndex = calloc(ctx->hashSize, sizeof(int));
+    if (ctx->hashIndex == NULL)
     {
-        perror("Failed to open archive file for reading");
+        perror("Memory allocation failed");
         exit(EXIT_FAILURE);
     }
 
-    // Read the header information from the archive file
-    ArchiveHeader header;
-    if (fread(&header, sizeof(ArchiveHeader), 1, archive) != 1)
+    for (int i = 0; i < ctx->numEntries; i++)
     {
-        perror("Failed to read archive header");
-        fclose(archive);
-        return;
+        unsigned int bucket = HashName(ctx->entries[i].name) & (ctx->hashSize - 1);
+        while (ctx->hashIndex[bucket] != 0)
+        {
+            bucket = (bucket + 1) & (ctx->hashSize - 1);
+        }
+        ctx->hashIndex[bucket] = i + 1;
     }
+}
 
-    // Retrieve the metadata offset entry, set it as the start of it
-    long nextEntryOffset = header.metadataOffset;
-
-    // For each entry (each file entity within the archive), we will attempt to extract
-    for (int i = 0; i < header.numEntries; i++)
+// Looks up an entry by its name in the archive, returning its index or -1 if there is none
+int FindEntry(DiffContext *ctx, const char *name)
+{
+    unsigned int bucket = HashName(name) & (ctx->hashSize - 1);
+    while (ctx->hashIndex[bucket] != 0)
     {
-        // Move to the next metadata entry
-        fseek(archive, nextEntryOffset, SEEK_SET);
+        int index = ctx->hashIndex[bucket] - 1;
+        if (strcmp(ctx->entries[index].name, name) == 0)
+            return index;
+        bucket = (bucket + 1) & (ctx->hashSize - 1);
+    }
+    return -1;
+}
 
-        ArchiveEntry entry;
-        if (fread(&entry, sizeof(ArchiveEntry), 1, archive) != 1)
+// Records a difference, workers report them in whatever order they find them so they get sorted at the end
+void AddDiffResult(DiffContext *ctx, char kind, const char *name)
+{
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->numResults == ctx->resultCapacity)
+    {
+        ctx->resultCapacity = ctx->resultCapacity ? ctx->resultCapacity * 2 : 64;
+        ctx->results = realloc(ctx->results, ctx->resultCapacity * sizeof(DiffResult));
+        if (ctx->results == NULL)
         {
-            perror("Failed to read metadata entry");
+            perror("Memory allocation failed");
             exit(EXIT_FAILURE);
         }
+    }
+    ctx->results[ctx->numResults].kind = kind;
+    ctx->results[ctx->numResults].name = strdup(name);
+    ctx->numResults++;
+    pthread_mutex_unlock(&ctx->lock);
+}
 
-        // Update the position to the next metadata entry
-        nextEntryOffset = ftell(archive);
-
-        // Append the entry to the current working directory path
-        char fullCDPath[PATH_MAX];
-
-        // Accounting for overflow in case the total full path exceeds the buffer size
-        snprintf(fullCDPath, sizeof(fullCDPath), "%s", basePath);
-        size_t remaining_size = sizeof(fullCDPath) - strlen(fullCDPath) - 1; // Minus 1 for the null terminator
-        strncat(fullCDPath, "/", remaining_size);
-        remaining_size = sizeof(fullCDPath) - strlen(fullCDPath) - 1; // Update remaining size
-        strncat(fullCDPath, entry.name, remaining_size);
+// Queues a live directory so that any idle worker can pick it up
+void QueueDiffWork(DiffContext *ctx, const char *livePath, const char *archiveName)
+{
+    DiffWork *work = malloc(sizeof(DiffWork));
+    if (work == NULL)
+    {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    work->livePath = strdup(livePath);
+    work->archiveName = strdup(archiveName);
+
+    pthread_mutex_lock(&ctx->lock);
+    work->next = ctx->queue;
+    ctx->queue = work;
+    ctx->pendingWork++;
+    pthread_cond_signal(&ctx->workAvailable);
+    pthread_mutex_unlock(&ctx->lock);
+}
 
-        // Debug to check if entries are valid
-        // printf("\nProcessing Entry: %s\nType: %c\nOffset: %ld\nSize: %ld\n",
-        //        fullCDPath, entry.type, entry.offset, entry.size);
+// Compares a live file byte by byte against its data in the archive, returning 1 if they are identical
+int SameFileContents(int dataFd, const ArchiveEntry *entry, const char *livePath)
+{
+    int liveFd = open(livePath, O_RDONLY);
+    if (liveFd == -1)
+        return 0;
+
+    char liveBuffer[65536], archiveBuffer[65536];
+    long compared = 0;
+    int same = 1;
+    while (same && compared < entry->size)
+    {
+        size_t chunk = entry->size - compared < (long)sizeof(liveBuffer) ? (size_t)(entry->size - compared) : sizeof(liveBuffer);
+        ssize_t liveRead = read(liveFd, liveBuffer, chunk);
+        ssize_t archiveRead = pread(dataFd, archiveBuffer, chunk, entry->offset + compared);
 
-        // Create a directory in this fullpath if it doesn't exist
-        if (entry.type == 'D')
+        // Stop at the first short read or mismatching byte
+        if (liveRead <= 0 || liveRead != archiveRead || memcmp(liveBuffer, archiveBuffer, liveRead) != 0)
         {
-            createDirectoryIfNotExists(fullCDPath);
+            same = 0;
         }
+        compared += liveRead > 0 ? liveRead : 0;
+    }
 
-        // Extracting files
-        if (entry.type == 'F')
-        {
-            FILE *outFile = fopen(fullCDPath, "wb");
-            if (!outFile)
-            {
-                perror("Failed to open output file for writing");
-                exit(EXIT_FAILURE);
-            }
+    close(liveFd);
+    return same;
+}
 
-            fseek(archive, entry.offset, SEEK_SET);
-            char buffer[1024];
-            long toRead = entry.size;
-            while (toRead > 0)
-            {
-                size_t bytesRead = fread(buffer, 1, (sizeof(buffer) < toRead ? sizeof(buffer) : toRead), archive);
-                fwrite(buffer, 1, bytesRead, outFile);
-                toRead -= bytesRead;
-            }
+// Compares a single live path with the archive entry of the same name, queueing it up if it is a directory
+void DiffPath(DiffContext *ctx, const char *livePath, const char *archiveName)
+{
+    struct stat st;
+    if (stat(livePath, &st) != 0)
+    {
+        perror("Failed to get file status");
+        return;
+    }
 
-            fclose(outFile);
-        }
+    int index = FindEntry(ctx, archiveName);
+    if (index == -1)
+    {
+        AddDiffResult(ctx, '+', archiveName);
     }
+    else
+    {
+        // Each name is only ever reached through one live path, so no two workers write the same flag
+        ctx->seen[index] = 1;
+        ArchiveEntry *entry = &ctx->entries[index];
 
-    fclose(archive);
-    printf("Extraction completed successfully\n");
-}
+        // Directories archived before their rights were recorded hold no usable mode, so only their type is compared
+        int modeRecorded = entry->type == 'F' || S_ISDIR(entry->rights);
 
-//================================================================ METADATA ================================================================================
-// This function will print out all relevant metadata information regarding the file/directory
-void PrintMetaData(const char *archiveFile)
-{
-    CheckIfArchiveExists(archiveFile);
+        // Cheap checks first, the contents are only read when the size and mode still match
+        if (S_ISDIR(st.st_mode) != (entry->type == 'D') || (modeRecorded && st.st_mode != entry->rights))
+        {
+            AddDiffResult(ctx, '~', archiveName);
+        }
+        else if (entry->type == 'F' && (st.st_size != entry->size || !SameFileContents(ctx->volumeFds[entry->volume], entry, livePath)))
+        {
+            AddDiffResult(ctx, '~', archiveName);
+        }
+    }
 
-    // Open the archive file in read mode
-    FILE *archive = fopen(archiveFile, "rb");
-    if (!archive)
+    if (S_ISDIR(st.st_mode))
     {
-        perror("Failed to open archive file for reading");
-        exit(EXIT_FAILURE);
+        QueueDiffWork(ctx, livePath, archiveName);
     }
+}
 
-    // Read the header information from the archive file
-    ArchiveHeader header;
-    if (fread(&header, sizeof(ArchiveHeader), 1, archive) != 1)
+// Compares every child of a live directory with the archive
+void DiffDirectory(DiffContext *ctx, DiffWork *work)
+{
+    DIR *dir = opendir(work->livePath);
+    if (!dir)
     {
-        perror("Failed to read archive header");
-        fclose(archive);
+        perror("Failed to open directory");
         return;
     }
 
-    // Move to the metadata section
-    fseek(archive, header.metadataOffset, SEEK_SET);
-
-    // Read existing metadata entries
-    ArchiveEntry entries[1000]; // assuming the cap of 1000 entries
-    if (fread(entries, sizeof(ArchiveEntry), header.numEntries, archive) != header.numEntries)
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
     {
-        perror("Failed to read existing metadata entries");
-        fclose(archive);
-        exit(EXIT_FAILURE);
+        // We skip the first two entries which are '.' and '..'
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char fullPath[PATH_MAX];
+        snprintf(fullPath, sizeof(fullPath), "%s/%s", work->livePath, entry->d_name);
+
+        char fullPathfromRoot[PATH_MAX];
+        snprintf(fullPathfromRoot, sizeof(fullPathfromRoot), "%s/%s", work->archiveName, entry->d_name);
+
+        DiffPath(ctx, fullPath, fullPathfromRoot);
     }
+    closedir(dir);
+}
 
-    // // Debug check to see if all entries have been read properly
-    // for(int i=0; i <header.numEntries; i++) {
-    //     printf("Reading in:\nName=%s\n Type=%c\n Size=%ld\n Offset=%ld\n", entries[i].name, entries[i].type, entries[i].size, entries[i].offset);
-    // }
+// Each worker keeps taking directories off the shared queue until the whole tree has been walked
+void *DiffWorker(void *arg)
+{
+    DiffContext *ctx = arg;
 
-    printf("Metadata information for each File/Directory:\n");
-    printf("---------------------------------------------\n");
-    // Print metadata for each entry
-    for (int i = 0; i < header.numEntries; i++)
+    pthread_mutex_lock(&ctx->lock);
+    while (1)
     {
-        ArchiveEntry entry = entries[i];
+        while (ctx->queue == NULL && ctx->pendingWork > 0)
+        {
+            pthread_cond_wait(&ctx->workAvailable, &ctx->lock);
+        }
 
-        // Get owner and group information
-        struct passwd *pwd = getpwuid(entry.owner);
-        struct group *grp = getgrgid(entry.group);
+        // Nothing queued and nobody is still working on a directory that could queue more
+        if (ctx->queue == NULL)
+            break;
 
-        // Get permissions string
-        char permStr[11];
-        getPermissionsString(entry.rights, permStr);
+        DiffWork *work = ctx->queue;
+        ctx->queue = work->next;
+        pthread_mutex_unlock(&ctx->lock);
 
-        // Print metadata information
-        printf("Name: %s\n", entry.name);
-        printf("Type: %c\n", entry.type);
-        printf("Owner: %s\n", pwd ? pwd->pw_name : "Unknown");
-        printf("Group: %s\n", grp ? grp->gr_name : "Unknown");
-        printf("Permissions: %s\n", permStr);
-        printf("Size: %ld bytes\n", entry.size);
-        printf("Offset: %ld\n", entry.offset);
-        printf("-------------------------\n");
+        DiffDirectory(ctx, work);
+        free(work->livePath);
+        free(work->archiveName);
+        free(work);
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->pendingWork--;
+        if (ctx->pendingWork == 0)
+        {
+            pthread_cond_broadcast(&ctx->workAvailable);
+        }
     }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
 
-    fclose(archive);
+int CompareDiffResults(const void *a, const void *b)
+{
+    return strcmp(((const DiffResult *)a)->name, ((const DiffResult *)b)->name);
 }
 
-//================================================================ DISPLAY ================================================================================
-// This function will display the hierarchy(-ies) within the archive file
-void DisplayArchive(const char *archiveFile)
+// This function compares the archive against a live file/directory without extracting anything,
+// printing every added, removed or changed path. It returns the number of differences found
+int DiffArchive(const char *archiveFile, char *inputPath)
 {
     CheckIfArchiveExists(archiveFile);
+    CheckIfInputPathExists(inputPath);
 
     // Open the archive file in read mode
     FILE *archive = fopen(archiveFile, "rb");
@@ -813,41 +3933,105 @@ void DisplayArchive(const char *archiveFile)
         exit(EXIT_FAILURE);
     }
 
-    // Read the header information from the archive file
-    ArchiveHeader header;
-    if (fread(&header, sizeof(ArchiveHeader), 1, archive) != 1)
+    // Read the header information and the metadata entries from the archive file
+    ArchiveHeaderSlot header;
+    ArchiveEntry entries[MAX_ARCHIVE_ENTRIES];
+    if (LoadArchive(archive, &header, entries) == -1)
     {
-        perror("Failed to read archive header");
         fclose(archive);
-        return;
+        exit(EXIT_FAILURE);
+    }
+
+    DiffContext ctx = {0};
+    ctx.entries = entries;
+    ctx.numEntries = header.numEntries;
+    char **volumePaths = LoadVolumeTable(archive, archiveFile, &header);
+    ctx.volumeFds = OpenVolumes(volumePaths, header.numVolumes);
+    ctx.seen = calloc(header.numEntries + 1, 1);
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.workAvailable, NULL);
+    BuildDiffIndex(&ctx);
+
+    // The live path is compared against the archived root with the same name, "dir/" must not give an empty one
+    TrimTrailingSlashes(inputPath);
+    char *rootOfDiff = strrchr(inputPath, '/');
+    if (rootOfDiff)
+    {
+        rootOfDiff++; // Skip the slash to get only the name or directory
     }
+    else
+    {
+        rootOfDiff = inputPath; // The path does not contain any slashes
+    }
+
+    // Compare the root ourselves, then let one worker per CPU walk whatever it queued
+    DiffPath(&ctx, inputPath, rootOfDiff);
 
-    // Move to the metadata section
-    fseek(archive, header.metadataOffset, SEEK_SET);
+    long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numThreads < 1)
+        numThreads = 1;
 
-    // Read existing metadata entries
-    ArchiveEntry entries[1000]; // assuming the cap of 1000 entries
-    if (fread(entries, sizeof(ArchiveEntry), header.numEntries, archive) != header.numEntries)
+    pthread_t *threads = malloc(numThreads * sizeof(pthread_t));
+    for (long i = 0; i < numThreads; i++)
     {
-        perror("Failed to read existing metadata entries");
-        fclose(archive);
-        exit(EXIT_FAILURE);
+        if (pthread_create(&threads[i], NULL, DiffWorker, &ctx) != 0)
+        {
+            perror("Failed to start diff worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (long i = 0; i < numThreads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    // Anything under the same root that no live path matched has been removed
+    size_t rootLen = strlen(rootOfDiff);
+    for (int i = 0; i < header.numEntries; i++)
+    {
+        const char *name = entries[i].name;
+        if (!ctx.seen[i] && strncmp(name, rootOfDiff, rootLen) == 0 && (name[rootLen] == '\0' || name[rootLen] == '/'))
+        {
+            AddDiffResult(&ctx, '-', name);
+        }
+    }
+
+    // Print everything in path order so the output does not depend on thread scheduling
+    qsort(ctx.results, ctx.numResults, sizeof(DiffResult), CompareDiffResults);
+    for (int i = 0; i < ctx.numResults; i++)
+    {
+        const char *label = ctx.results[i].kind == '+' ? "Added" : ctx.results[i].kind == '-' ? "Removed" : "Changed";
+        printf("%-8s %s\n", label, ctx.results[i].name);
+        free(ctx.results[i].name);
     }
 
+    int numDifferences = ctx.numResults;
+    printf("%d difference(s) found\n", numDifferences);
+
+    free(ctx.results);
+    free(ctx.hashIndex);
+    free(ctx.seen);
+    for (int v = 0; v <= header.numVolumes; v++)
+    {
+        close(ctx.volumeFds[v]);
+    }
+    free(ctx.volumeFds);
+    pthread_mutex_destroy(&ctx.lock);
+    pthread_cond_destroy(&ctx.workAvailable);
     fclose(archive);
 
-    // Display the hierarchy
-    printf("Archived Hierarchy(-ies):\n");
-    printf("--------------------------------");
-    DisplayHierarchy(entries, header.numEntries, 0, "");
+    return numDifferences;
 }
 
 //================================================================ MAIN ================================================================================
 // Main Function
 int main(int argc, char *argv[])
 {
-    char *flag = NULL, *archiveFile = NULL, *file_directory = NULL;
-    ParseArguments(argc, argv, &flag, &archiveFile, &file_directory);
+    char *flag = NULL, *archiveFile = NULL, **file_directories = NULL;
+    int numFileDirectories = 0;
+    ParseArguments(argc, argv, &flag, &archiveFile, &file_directories, &numFileDirectories);
+    char *file_directory = file_directories[0];
 
     // If the flag is "-c" for create
     if (strcmp(flag, "-c") == 0)
@@ -879,5 +4063,38 @@ int main(int argc, char *argv[])
         DisplayArchive(archiveFile);
     }
 
+    // Else if the flag is "-u" for disk usage
+    else if (strcmp(flag, "-u") == 0)
+    {
+        PrintDiskUsage(archiveFile, file_directory);
+    }
+
+    // Else if the flag is "-i" for importing a tar stream
+    else if (strcmp(flag, "-i") == 0)
+    {
+        ImportTar(archiveFile, file_directory);
+    }
+
+    // Else if the flag is "-e" for exporting a tar stream
+    else if (strcmp(flag, "-e") == 0)
+    {
+        ExportTar(archiveFile, file_directory);
+    }
+
+    // Else if the flag is "-j" for joining several archives into one
+    else if (strcmp(flag, "-j") == 0)
+    {
+        MergeArchives(archiveFile, file_directories, numFileDirectories);
+    }
+
+    // Else if the flag is "-d" for diff, exiting with 1 like diff(1) when anything drifted
+    else if (strcmp(flag, "-d") == 0)
+    {
+        if (DiffArchive(archiveFile, file_directory) > 0)
+        {
+            return (EXIT_FAILURE);
+        }
+    }
+
     return (EXIT_SUCCESS);
 }
@@ -0,0 +1,74 @@
+#!/bin/bash
+# Checks that readers can run while appends are committing: two appenders race on the same archive while -m, -d
+# and -u keep reading it. No reader may fail or see a generation go backwards, and no append may get lost.
+#
+# Usage: tests/concurrent_readers.sh [path to adzip], run from anywhere
+
+source "$(dirname "$0")/lib.sh"
+
+APPENDS=120
+
+mkdir -p base piece
+echo base > base/file.txt
+head -c 300000 /dev/urandom > piece/data.bin
+echo small > piece/small.txt
+
+"$ADZIP" -c shared.ad base > /dev/null
+
+for appender in 1 2; do
+    (
+        for i in $(seq 1 "$APPENDS"); do
+            if ! "$ADZIP" -a shared.ad piece > /dev/null 2>> "append$appender.log"; then
+                echo "append $i failed" >> "append$appender.log"
+            fi
+        done
+    ) &
+done
+
+# Read until both appenders are done, every -m has to succeed and show a generation no older than the one before
+last=0
+reads=0
+while [ "$(jobs -r | wc -l)" -gt 0 ]; do
+    if ! output=$("$ADZIP" -m shared.ad x 2> read.err); then
+        fail "-m failed while appends were running: $(cat read.err)"
+        break
+    fi
+    generation=$(sed -n 's/^(Archive generation \([0-9]*\))$/\1/p' <<< "$output")
+    if [ -z "$generation" ] || [ "$generation" -lt "$last" ]; then
+        fail "-m read generation '$generation' after already having read $last"
+        break
+    fi
+    last=$generation
+
+    "$ADZIP" -d shared.ad base > /dev/null 2> read.err
+    if [ $? -gt 1 ] || [ -s read.err ]; then
+        fail "-d failed while appends were running: $(cat read.err)"
+        break
+    fi
+    if ! "$ADZIP" -u shared.ad . > /dev/null 2> read.err; then
+        fail "-u failed while appends were running: $(cat read.err)"
+        break
+    fi
+    reads=$((reads + 1))
+done
+wait
+
+for appender in 1 2; do
+    if [ -s "append$appender.log" ]; then
+        fail "appender $appender reported errors: $(cat "append$appender.log")"
+    fi
+done
+
+# Every append landed: one generation each on top of the creation, and one renamed hierarchy each
+if ! "$ADZIP" -m shared.ad x | grep -q "(Archive generation $((1 + 2 * APPENDS)))"; then
+    fail "expected generation $((1 + 2 * APPENDS)) after $((2 * APPENDS)) appends, got: $("$ADZIP" -m shared.ad x | grep generation)"
+fi
+roots=$("$ADZIP" -m shared.ad x | sed -n 's/^Name: //p' | grep -c '^piece[^/]*$')
+if [ "$roots" -ne $((2 * APPENDS)) ]; then
+    fail "expected $((2 * APPENDS)) appended hierarchies, found $roots"
+fi
+if [ "$reads" -eq 0 ]; then
+    fail "the appends were over before anything could read alongside them"
+fi
+
+finish
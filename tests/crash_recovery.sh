@@ -0,0 +1,105 @@
+#!/bin/bash
+# Injects crashes into the archive header protocol and checks that the archive stays readable:
+# a torn header slot, corrupt metadata and interrupted creations/appends must all leave -m working
+# on the previous generation (or on an empty archive if nothing was ever committed).
+#
+# Usage: tests/crash_recovery.sh [path to adzip], run from anywhere
+
+source "$(dirname "$0")/lib.sh"
+
+# Reads a little endian 8-byte number out of the archive
+read_long()
+{
+    od -An -t d8 -j "$2" -N 8 "$1" | tr -d ' '
+}
+
+# Overwrites bytes of the archive in place
+scribble()
+{
+    printf 'garbage!garbage!' | dd of="$1" bs=1 seek="$2" conv=notrunc status=none
+}
+
+# -m must succeed, report the expected generation and list exactly the expected top-level entries
+expect_readable()
+{
+    local archive=$1 generation=$2 entries=$3 what=$4
+    local output
+    if ! output=$("$ADZIP" -m "$archive" x 2>&1); then
+        fail "$what: -m failed: $output"
+        return
+    fi
+    if [ "$generation" -gt 0 ] && ! grep -q "(Archive generation $generation)" <<< "$output"; then
+        fail "$what: expected generation $generation, got: $(grep generation <<< "$output")"
+    fi
+    local names
+    names=$(grep '^Name: ' <<< "$output" | grep -v / | sed 's/^Name: //' | tr '\n' ' ')
+    if [ "$names" != "$entries" ]; then
+        fail "$what: expected entries '$entries', got '$names'"
+    fi
+}
+
+mkdir -p first/sub second
+echo one > first/a.txt
+echo two > first/sub/b.txt
+head -c 200000 /dev/urandom > second/data.bin
+
+# Generation 1 holds 'first' and lives in the slot at 1024, generation 2 adds 'second' in the slot at 512
+"$ADZIP" -c base.ad first > /dev/null
+"$ADZIP" -a base.ad second > /dev/null
+expect_readable base.ad 2 "first second " "intact archive"
+
+# A torn write of the newest slot falls back to the previous generation
+cp base.ad torn.ad
+scribble torn.ad 532
+expect_readable torn.ad 1 "first " "torn slot"
+
+# Metadata that does not match its checksum falls back to the previous generation
+cp base.ad corrupt.ad
+scribble corrupt.ad "$(read_long corrupt.ad 520)"
+expect_readable corrupt.ad 1 "first " "corrupt metadata"
+
+# An append that died while writing its metadata never got to write its slot, but even if the slot
+# made it the metadata it points at is cut off, so the previous generation is used
+cp base.ad cut.ad
+truncate -s $(($(read_long cut.ad 520) + 3)) cut.ad
+expect_readable cut.ad 1 "first " "append cut off in its metadata"
+
+# A creation that never committed reads as an empty archive, and can still be appended to
+cp base.ad uncommitted.ad
+dd if=/dev/zero of=uncommitted.ad bs=512 seek=1 count=2 conv=notrunc status=none
+expect_readable uncommitted.ad 0 "" "creation that never committed"
+: > nothing.ad
+expect_readable nothing.ad 0 "" "creation that wrote nothing"
+"$ADZIP" -a nothing.ad first > /dev/null
+expect_readable nothing.ad 1 "first " "append onto a creation that wrote nothing"
+
+# Kill real creations and appends at random points, whatever state they leave must be readable
+mkdir -p big
+for i in $(seq 1 40); do
+    head -c 1000000 /dev/urandom > "big/file$i.bin"
+done
+
+for i in $(seq 1 15); do
+    rm -f killed.ad
+    "$ADZIP" -c killed.ad big > /dev/null &
+    pid=$!
+    sleep "0.0$((RANDOM % 10))"
+    kill -9 "$pid" 2> /dev/null
+    wait "$pid" 2> /dev/null
+    if ! "$ADZIP" -m killed.ad x > /dev/null 2>&1; then
+        fail "creation killed at run $i left an unreadable archive"
+    fi
+
+    cp base.ad appended.ad
+    "$ADZIP" -a appended.ad big > /dev/null &
+    pid=$!
+    sleep "0.0$((RANDOM % 10))"
+    kill -9 "$pid" 2> /dev/null
+    wait "$pid" 2> /dev/null
+    output=$("$ADZIP" -m appended.ad x 2>&1)
+    if [ $? -ne 0 ] || ! grep -q "(Archive generation [23])" <<< "$output"; then
+        fail "append killed at run $i left an unreadable archive"
+    fi
+done
+
+finish
@@ -0,0 +1,48 @@
+#!/bin/bash
+# Checks -d: an untouched tree matches its archive, and added, removed and changed paths are all reported, including
+# a mode change and a content change that keeps the size and modification time. "src/" is compared just like "src".
+#
+# Usage: tests/diff.sh [path to adzip], run from anywhere
+
+source "$(dirname "$0")/lib.sh"
+
+# -d must exit with the given status and report exactly the expected lines, given one per argument
+expect_diff()
+{
+    local path=$1 status=$2
+    shift 2
+    local expected
+    expected=$(printf '%s\n' "$@")
+    local got
+    got=$("$ADZIP" -d tree.ad "$path" 2> diff.err)
+    local got_status=$?
+    if [ "$got_status" -ne "$status" ] || [ "$got" != "$expected" ] || [ -s diff.err ]; then
+        fail "-d tree.ad $path exited with $got_status and gave:"$'\n'"$got$(cat diff.err)"$'\n'"expected exit $status and:"$'\n'"$expected"
+    fi
+}
+
+mkdir -p src/sub
+echo first > src/grown.txt
+echo same > src/edited.txt
+echo mode > src/mode.txt
+echo old > src/sub/old.txt
+echo kept > src/sub/kept.txt
+
+"$ADZIP" -c tree.ad src > /dev/null
+expect_diff src 0 "0 difference(s) found"
+expect_diff src/ 0 "0 difference(s) found"
+
+echo "first, and then some" > src/grown.txt
+touch -r src/edited.txt edited.time
+echo SAME > src/edited.txt
+touch -r edited.time src/edited.txt
+chmod 600 src/mode.txt
+rm src/sub/old.txt
+echo new > src/sub/new.txt
+
+changes=("Changed  src/edited.txt" "Changed  src/grown.txt" "Changed  src/mode.txt" "Added    src/sub/new.txt"
+         "Removed  src/sub/old.txt" "5 difference(s) found")
+expect_diff src 1 "${changes[@]}"
+expect_diff src/ 1 "${changes[@]}"
+
+finish
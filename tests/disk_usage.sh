@@ -0,0 +1,78 @@
+#!/bin/bash
+# Checks -u: the totals, file counts and depths of every directory at or below a path, across appends, and that they
+# come from the directory summaries alone. Archives without summaries (tests/fixtures, see metadata_format.sh) must
+# give the same answers by falling back to the metadata.
+#
+# Usage: tests/disk_usage.sh [path to adzip], run from anywhere
+
+FIXTURES=$(realpath "$(dirname "$0")/fixtures")
+source "$(dirname "$0")/lib.sh"
+
+# Prints the rows of -u as "name bytes files levels", one per line
+usage()
+{
+    "$ADZIP" -u "$1" "$2" 2> /dev/null | awk '$2 == "bytes" { name = $0; sub(/^ *[0-9]+ bytes +[0-9]+ files +[0-9]+ levels +/, "", name); print name, $1, $3, $5 }'
+}
+
+# -u must answer exactly the expected rows, given one per argument
+expect_usage()
+{
+    local archive=$1 path=$2
+    shift 2
+    local expected
+    expected=$(printf '%s\n' "$@")
+    local got
+    got=$(usage "$archive" "$path")
+    if [ "$got" != "$expected" ]; then
+        fail "-u $archive $path gave:"$'\n'"$got"$'\n'"expected:"$'\n'"$expected"
+    fi
+}
+
+mkdir -p project/src/lib project/docs other
+head -c 1000 /dev/zero > project/top.bin
+head -c 200 /dev/zero > project/src/main.c
+head -c 30 /dev/zero > project/src/lib/util.c
+head -c 4 /dev/zero > project/src/lib/util.h
+head -c 7 /dev/zero > other/note.txt
+
+"$ADZIP" -c usage.ad project > /dev/null
+expect_usage usage.ad . \
+    "project 1234 4 3" "project/docs 0 0 0" "project/src 234 3 2" "project/src/lib 34 2 1"
+expect_usage usage.ad project/src "project/src 234 3 2" "project/src/lib 34 2 1"
+expect_usage usage.ad project/src/ "project/src 234 3 2" "project/src/lib 34 2 1"
+expect_usage usage.ad project/top.bin "project/top.bin 1000 1 0"
+if "$ADZIP" -u usage.ad missing > /dev/null 2>&1; then
+    fail "-u on a path that is not in the archive succeeded"
+fi
+
+# An append adds its own hierarchy, and a second copy of a name gets renamed like everywhere else
+"$ADZIP" -a usage.ad other > /dev/null
+"$ADZIP" -a usage.ad project > /dev/null
+expect_usage usage.ad other "other 7 1 1"
+expect_usage usage.ad "project 1" \
+    "project 1 1234 4 3" "project 1/docs 0 0 0" "project 1/src 234 3 2" "project 1/src/lib 34 2 1"
+before=$(usage usage.ad .)
+
+# "other/" is the same hierarchy as "other", not one with an empty name
+"$ADZIP" -c slash.ad other/ > /dev/null
+"$ADZIP" -a slash.ad other/ > /dev/null
+expect_usage slash.ad . "other 7 1 1" "other 1 7 1 1"
+
+# With the newest generation's metadata destroyed, -m falls back to the previous generation. -u does not read the
+# metadata at all, so it still answers for the newest generation. Generation 3 lives in the slot at 1024
+metadata=$(od -An -t d8 -j 1032 -N 8 usage.ad | tr -d ' ')
+printf 'garbage!garbage!' | dd of=usage.ad bs=1 seek="$metadata" conv=notrunc status=none
+if ! "$ADZIP" -m usage.ad x 2> /dev/null | grep -q "(Archive generation 2)"; then
+    fail "-m did not fall back to generation 2 after its metadata was destroyed"
+fi
+if [ "$(usage usage.ad .)" != "$before" ]; then
+    fail "-u read the metadata of the newest generation instead of just the summaries"
+fi
+
+# Archives without summaries work it out from their metadata
+for archive in legacy-v1.ad legacy-v2.ad; do
+    expect_usage "$FIXTURES/$archive" . "old 5018 3 3" "old/docs 5012 2 2" "old/docs/deep 5000 1 1"
+    expect_usage "$FIXTURES/$archive" old/docs "old/docs 5012 2 2" "old/docs/deep 5000 1 1"
+done
+
+finish
@@ -0,0 +1,28 @@
+#!/bin/bash
+# Shared setup for the test scripts, sourced first thing by each of them. It resolves the adzip binary from the
+# script's first argument (the one next to tests/ by default), moves into a fresh work directory that is removed
+# on exit, and provides fail() to record a failed check and finish() to report the result and exit with it.
+# Not a test itself, so make test leaves it out.
+
+TEST_NAME=$(basename "$0" .sh)
+ADZIP=$(realpath "${1:-$(dirname "$0")/../adzip}")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+failures=0
+fail()
+{
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+finish()
+{
+    if [ "$failures" -gt 0 ]; then
+        echo "$TEST_NAME: $failures failure(s)"
+        exit 1
+    fi
+    echo "$TEST_NAME: all checks passed"
+    exit 0
+}
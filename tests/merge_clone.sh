@@ -0,0 +1,48 @@
+#!/bin/bash
+# Checks that merged archives extract to exactly what went into their inputs, through the path that moves big
+# files within the kernel (sharing their blocks where it can) as well as the ordinary one.
+# Block sharing itself needs a filesystem with reflinks (btrfs, XFS): point REFLINK_DIR at a directory on one
+# to also check that merging shares the data instead of copying it. Without it that check is skipped.
+#
+# Usage: [REFLINK_DIR=dir] tests/merge_clone.sh [path to adzip], run from anywhere
+
+# The work directory goes on the reflink filesystem when there is one
+if [ -n "$REFLINK_DIR" ]; then
+    export TMPDIR=$REFLINK_DIR
+fi
+source "$(dirname "$0")/lib.sh"
+
+mkdir -p alpha/sub beta
+echo small > alpha/sub/small.txt
+head -c 3000000 /dev/urandom > alpha/big.bin
+head -c 1500001 /dev/urandom > beta/odd.bin
+head -c 70000 /dev/urandom > beta/medium.bin
+
+"$ADZIP" -c alpha.ad alpha > /dev/null
+# A --direct archive puts its big files on block boundaries, the only ones extraction can share
+"$ADZIP" -c --direct beta.ad beta > /dev/null
+if ! "$ADZIP" -j merged.ad alpha.ad beta.ad > merge.log 2>&1; then
+    fail "merge failed: $(cat merge.log)"
+fi
+
+mkdir extract
+(cd extract && "$ADZIP" -x ../merged.ad x > /dev/null 2> ../extract.log)
+if [ -s extract.log ]; then
+    fail "extraction complained: $(cat extract.log)"
+fi
+for tree in alpha beta; do
+    if ! diff -r "$tree" "extract/$tree" > /dev/null; then
+        fail "$tree does not extract from the merged archive as it was archived"
+    fi
+done
+
+if [ -n "$REFLINK_DIR" ]; then
+    shared=$(sed -n 's/.*(\([0-9]*\) of [0-9]* bytes shared.*/\1/p' merge.log)
+    if [ "${shared:-0}" -eq 0 ]; then
+        fail "merging on $REFLINK_DIR shared no data: $(cat merge.log)"
+    fi
+else
+    echo "$TEST_NAME: REFLINK_DIR not set, skipping the block sharing check"
+fi
+
+finish
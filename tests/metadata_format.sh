@@ -0,0 +1,94 @@
+#!/bin/bash
+# Checks the front-coded (version 3) metadata: archives round trip, names are no longer cut off at 256 bytes, and
+# the table stays small. Also checks that archives written by earlier versions of adzip are still read and appended
+# to in their own layout. tests/fixtures/legacy-v1.ad was made by the original adzip (bare header, fixed-width
+# entries) and tests/fixtures/legacy-v2.ad by the first version with header slots, both from the same tree:
+#   old/readme.txt "hello", old/docs/draft.txt "first draft", old/docs/deep/blob.bin 5000 times "x"
+#
+# Usage: tests/metadata_format.sh [path to adzip], run from anywhere
+
+FIXTURES=$(realpath "$(dirname "$0")/fixtures")
+source "$(dirname "$0")/lib.sh"
+
+# Reads a little endian number of the given size out of the archive
+read_number()
+{
+    od -An -t "d$3" -j "$2" -N "$3" "$1" | tr -d ' '
+}
+
+# Prints the names -m lists, on one line
+names()
+{
+    "$ADZIP" -m "$1" x 2> /dev/null | sed -n 's/^Name: //p' | tr '\n' ' '
+}
+
+# A path well past the 256 bytes the fixed-width entries had room for
+long=$(printf 'd%.0s' $(seq 1 200))
+mkdir -p "tree/$long/$long" tree/docs
+echo deep > "tree/$long/$long/far.txt"
+for f in $(seq 1 40); do
+    echo "file $f" > "tree/docs/note$f.txt"
+done
+
+"$ADZIP" -c current.ad tree > /dev/null
+if [ "$(read_number current.ad 8 4)" -ne 3 ]; then
+    fail "a new archive is not version 3"
+fi
+if ! names current.ad | grep -q "tree/$long/$long/far.txt "; then
+    fail "the name longer than 256 bytes did not come back whole from -m"
+fi
+
+# Generation 1 is in the slot at 1024: metadata size at +16, entry count at +24
+size=$(read_number current.ad 1040 8)
+count=$(read_number current.ad 1048 4)
+if [ "$count" -ne 45 ] || [ $((size / count)) -ge 64 ]; then
+    fail "expected 45 entries of a few dozen bytes each, got $count entries in $size bytes"
+fi
+
+mkdir extract
+(cd extract && "$ADZIP" -x ../current.ad x > /dev/null)
+if ! diff -r tree extract/tree > /dev/null; then
+    fail "the version 3 archive does not extract to what was archived"
+fi
+
+old_names="old old/readme.txt old/docs old/docs/draft.txt old/docs/deep old/docs/deep/blob.bin "
+for version in 1 2; do
+    archive="legacy-v$version.ad"
+    cp "$FIXTURES/$archive" .
+
+    if [ "$(names "$archive")" != "$old_names" ]; then
+        fail "version $version archive lists '$(names "$archive")'"
+    fi
+
+    rm -rf extract
+    mkdir extract
+    (cd extract && "$ADZIP" -x "../$archive" x > /dev/null)
+    if [ "$(cat extract/old/readme.txt)" != "hello" ] || [ "$(cat extract/old/docs/draft.txt)" != "first draft" ] ||
+       [ "$(tr -d x < extract/old/docs/deep/blob.bin | wc -c)" -ne 0 ] || [ "$(wc -c < extract/old/docs/deep/blob.bin)" -ne 5000 ]; then
+        fail "version $version archive does not extract to what was archived"
+    fi
+
+    # Appending keeps the archive's own layout, so the adzip that wrote it can still read it
+    mkdir -p added
+    echo more > added/more.txt
+    "$ADZIP" -a "$archive" added > /dev/null
+    if [ "$(names "$archive")" != "${old_names}added added/more.txt " ]; then
+        fail "appending to the version $version archive gave '$(names "$archive")'"
+    fi
+    if [ "$version" -eq 1 ] && printf ADZIPARC | cmp -s -n 8 - "$archive"; then
+        fail "appending to the version 1 archive gave it a superblock"
+    fi
+    if [ "$version" -eq 2 ] && [ "$(read_number "$archive" 8 4)" -ne 2 ]; then
+        fail "appending to the version 2 archive changed its version"
+    fi
+
+    # A name that does not fit the fixed-width layout is refused before anything is committed
+    if "$ADZIP" -a "$archive" tree > append.log 2>&1 || ! grep -q "too long for a version $version archive" append.log; then
+        fail "appending a long name to the version $version archive was not refused: $(cat append.log)"
+    fi
+    if [ "$(names "$archive")" != "${old_names}added added/more.txt " ]; then
+        fail "the refused append changed the version $version archive"
+    fi
+done
+
+finish
@@ -0,0 +1,138 @@
+#!/bin/bash
+# Kills creations at random points and checks that --resume always finishes them into the very archive an
+# uninterrupted run makes, including when the resume itself is killed, the checkpoint ends in a torn record or the
+# walk had skipped a file it could not read.
+# Also checks that an input with more entries than an archive can hold is refused instead of crashing.
+#
+# Usage: tests/resume_kill.sh [path to adzip], run from anywhere
+
+source "$(dirname "$0")/lib.sh"
+
+# Runs a command in the background and kills it at a random moment within how long a whole creation takes
+run_and_kill()
+{
+    "$@" > /dev/null 2>&1 &
+    local pid=$!
+    sleep "$(printf '0.%06d' $((RANDOM * 32768 % duration)))"
+    kill -9 "$pid" 2> /dev/null
+    wait "$pid" 2> /dev/null
+}
+
+# Many small files so checkpoints are written by entry count, and a few big ones so they are written by size too
+mkdir -p tree
+for d in $(seq 1 6); do
+    mkdir -p "tree/dir$d"
+    for f in $(seq 1 80); do
+        head -c $((RANDOM * 4)) /dev/urandom > "tree/dir$d/file$f.bin"
+    done
+done
+for d in 2 4 6; do
+    head -c 30000000 /dev/urandom > "tree/dir$d/big.bin"
+done
+
+start=$(date +%s%N)
+"$ADZIP" -c reference.ad tree > /dev/null
+duration=$((($(date +%s%N) - start) / 1000))
+if [ "$duration" -gt 999999 ]; then
+    duration=999999
+fi
+
+checkpointed=0
+for i in $(seq 1 12); do
+    rm -f resumed.ad resumed.ad.ckpt
+    run_and_kill "$ADZIP" -c resumed.ad tree
+    if [ -f resumed.ad.ckpt ]; then
+        checkpointed=$((checkpointed + 1))
+    fi
+
+    # Every third run the resume gets killed as well, every fourth one finds a torn record at the end of the checkpoint
+    if [ $((i % 3)) -eq 0 ]; then
+        run_and_kill "$ADZIP" -c --resume resumed.ad tree
+    fi
+    if [ $((i % 4)) -eq 0 ] && [ -f resumed.ad.ckpt ]; then
+        printf 'ADZIPCKPtorn' >> resumed.ad.ckpt
+    fi
+    if [ ! -e resumed.ad.ckpt ] && cmp -s resumed.ad reference.ad; then
+        # The last run finished before it was killed, there is nothing left to resume
+        continue
+    fi
+
+    if ! "$ADZIP" -c --resume resumed.ad tree > resume.log 2>&1; then
+        fail "resume failed at run $i: $(cat resume.log)"
+    elif ! cmp -s resumed.ad reference.ad; then
+        fail "resumed archive differs from an uninterrupted creation at run $i"
+    elif [ -e resumed.ad.ckpt ]; then
+        fail "checkpoint left behind after the resume finished at run $i"
+    fi
+done
+if [ "$checkpointed" -eq 0 ]; then
+    fail "no creation was killed after writing a checkpoint, nothing was resumed"
+fi
+
+# A file the walk cannot archive before the checkpoint must not stop the resume. A FIFO at the end of the walk blocks
+# the creation for good once it is past the first checkpoint (64 entries), so it can be killed right there
+mkdir -p skipping
+for f in $(seq -w 0 99); do
+    echo "$f" > "skipping/f0$f"
+done
+ln -s nowhere skipping/f005s
+"$ADZIP" -c skipping-reference.ad skipping > /dev/null 2>&1
+mkfifo skipping/zz
+"$ADZIP" -c skipping.ad skipping > /dev/null 2>&1 &
+pid=$!
+for i in $(seq 1 100); do
+    [ -s skipping.ad.ckpt ] && break
+    sleep 0.1
+done
+# Give the first record time to be written in full, the creation is not going anywhere past the FIFO anyway
+sleep 0.5
+kill -9 "$pid" 2> /dev/null
+wait "$pid" 2> /dev/null
+
+# A durable creation only checkpoints by data size, so these 101 small files must not have made it write one
+"$ADZIP" -c --durable durable.ad skipping > /dev/null 2>&1 &
+pid=$!
+sleep 1
+if [ -e durable.ad.ckpt ]; then
+    fail "a durable creation of a few KiB wrote a checkpoint, paying two syncs for it"
+fi
+kill -9 "$pid" 2> /dev/null
+wait "$pid" 2> /dev/null
+rm skipping/zz
+
+# The skipped file can be read by now, but it stays left out like in the run that was interrupted
+ln -sf f000 skipping/f005s
+if [ ! -f skipping.ad.ckpt ]; then
+    fail "the creation blocked on the FIFO never wrote a checkpoint"
+elif ! "$ADZIP" -c --resume skipping.ad skipping > resume.log 2>&1; then
+    fail "resume past a file the walk skipped failed: $(cat resume.log)"
+elif ! cmp -s skipping.ad skipping-reference.ad; then
+    fail "resume past a file the walk skipped differs from an uninterrupted creation"
+fi
+
+# More entries than an archive can hold are refused, by a creation as well as by an append
+mkdir -p huge half
+for f in $(seq 1 1100); do
+    : > "huge/file$f"
+done
+for f in $(seq 1 600); do
+    : > "half/file$f"
+done
+
+"$ADZIP" -c huge.ad huge > /dev/null 2> huge.log
+status=$?
+if [ "$status" -ne 1 ] || ! grep -q "more than 1000 entries" huge.log; then
+    fail "creating from 1100 files exited with $status: $(cat huge.log)"
+fi
+
+"$ADZIP" -c half.ad half > /dev/null
+"$ADZIP" -a half.ad half > /dev/null 2> half.log
+status=$?
+if [ "$status" -ne 1 ] || ! grep -q "more than 1000 entries" half.log; then
+    fail "appending past 1000 entries exited with $status: $(cat half.log)"
+fi
+if ! "$ADZIP" -m half.ad x 2> /dev/null | grep -q "(Archive generation 1)"; then
+    fail "the refused append did not leave the archive at its previous generation"
+fi
+
+finish
@@ -0,0 +1,68 @@
+#!/bin/bash
+# Checks that importing a tar stream never lets a member name reach outside the extraction directory,
+# and that the names it keeps are cleaned up the same way tar would.
+#
+# Usage: tests/tar_import.sh [path to adzip], run from anywhere
+
+source "$(dirname "$0")/lib.sh"
+
+# Extraction happens two levels down, so whatever "../../" escapes to still lands inside the work directory
+mkdir -p source/inner/deep box/extract
+echo outside > escaped.txt
+echo inside > source/inner/deep/kept.txt
+echo tidy > source/inner/deep/other.txt
+
+# -P keeps the ".." and "//" in the member names instead of stripping them like tar normally would
+(cd source/inner && tar -cPf "$WORK/hostile.tar" ../../escaped.txt deep/../../inner/deep/kept.txt .//deep/./other.txt)
+rm escaped.txt
+
+if ! "$ADZIP" -i hostile.ad hostile.tar > import.log 2>&1; then
+    fail "import failed: $(cat import.log)"
+fi
+if [ "$(grep -c "containing '..'" import.log)" -ne 2 ]; then
+    fail "expected both '..' members to be skipped: $(cat import.log)"
+fi
+
+(cd box/extract && "$ADZIP" -x ../../hostile.ad x > /dev/null)
+found=$(cd box/extract && find . -type f | sort | tr '\n' ' ')
+if [ "$found" != "./deep/other.txt " ]; then
+    fail "expected only ./deep/other.txt to be extracted, got '$found'"
+fi
+if [ -e escaped.txt ] || [ -e box/inner ]; then
+    fail "a member was written outside the extraction directory"
+fi
+if [ "$(cat box/extract/deep/other.txt 2> /dev/null)" != "tidy" ]; then
+    fail "deep/other.txt does not hold what was archived"
+fi
+
+# "//" and "/./" must not turn into directories of their own
+listing=$("$ADZIP" -m hostile.ad x | grep '^Name: ' | sed 's/^Name: //' | tr '\n' ' ')
+if [ "$listing" != "deep deep/other.txt " ]; then
+    fail "expected entries 'deep deep/other.txt', got '$listing'"
+fi
+
+# Sets the size field of the tar header at the given offset and fixes up the header checksum to match
+set_tar_size()
+{
+    local file=$1 header=$2 size=$3
+    printf '%011o\0' "$size" | dd of="$file" bs=1 seek=$((header + 124)) conv=notrunc status=none
+    printf '        ' | dd of="$file" bs=1 seek=$((header + 148)) conv=notrunc status=none
+    local sum
+    sum=$(od -An -tu1 -v -j "$header" -N 512 "$file" | tr -s ' ' '\n' | awk '{ total += $1 } END { print total }')
+    printf '%06o\0 ' "$sum" | dd of="$file" bs=1 seek=$((header + 148)) conv=notrunc status=none
+}
+
+# A pax header claiming 8 GiB must be refused up front rather than read into memory
+mkdir -p paxbig
+echo data > "paxbig/$(printf 'n%.0s' $(seq 1 150))"
+tar --format=pax -cf huge-pax.tar paxbig
+if [ "$(dd if=huge-pax.tar bs=1 skip=156 count=1 status=none)" != "x" ]; then
+    fail "tar did not start the stream with a pax header"
+else
+    set_tar_size huge-pax.tar 0 $((8 * 1024 * 1024 * 1024 - 1))
+    if "$ADZIP" -i huge-pax.ad huge-pax.tar > huge-pax.log 2>&1 || ! grep -q "extended header of 8589934591 bytes" huge-pax.log; then
+        fail "a pax header claiming 8 GiB was not refused: $(cat huge-pax.log)"
+    fi
+fi
+
+finish
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Checks that files which cannot be opened are left out of the archive, whether the data is written during the walk,
+# into volumes or with --direct. Volumes and --direct lay out the data before reading it, so there a file that ends
+# before the size it reported is left out too, while the walk simply archives what it read.
+#
+# Usage: tests/unreadable_inputs.sh [path to adzip], run from anywhere
+
+source "$(dirname "$0")/lib.sh"
+
+mkdir -p input
+head -c 100000 /dev/urandom > input/first.bin
+head -c 200000 /dev/urandom > input/last.bin
+echo small > input/small.txt
+
+# Sysfs files report a size of 4096 but hold far less, and a socket cannot be opened at all
+ln -s /sys/kernel/uevent_seqnum input/short.sys
+if command -v python3 > /dev/null; then
+    python3 -c "import socket; socket.socket(socket.AF_UNIX).bind('input/unopenable.sock')"
+else
+    echo "$TEST_NAME: python3 not found, skipping the socket"
+fi
+
+for mode in "" "--volumes=2" "--direct"; do
+    rm -rf extract archive.ad archive.ad.*
+    "$ADZIP" -c $mode "archive.ad" input > create.log 2>&1
+    status=$?
+    if [ "$status" -ne 0 ]; then
+        fail "creation with '$mode' exited with $status: $(cat create.log)"
+        continue
+    fi
+
+    expected="input input/first.bin input/last.bin input/small.txt "
+    if [ -z "$mode" ]; then
+        expected="input input/first.bin input/last.bin input/short.sys input/small.txt "
+    fi
+    names=$("$ADZIP" -m archive.ad x | sed -n 's/^Name: //p' | tr '\n' ' ')
+    if [ "$names" != "$expected" ]; then
+        fail "creation with '$mode' archived '$names', expected '$expected'"
+    fi
+
+    mkdir extract
+    (cd extract && "$ADZIP" -x ../archive.ad x > /dev/null 2>&1)
+    for file in first.bin last.bin small.txt; do
+        if ! cmp -s "input/$file" "extract/input/$file"; then
+            fail "$file does not extract as it was archived with '$mode'"
+        fi
+    done
+done
+
+finish
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Checks archives split across volume files: they extract to what was archived, and a volume that lost data makes
+# -x and -e fail instead of quietly handing out short files.
+#
+# Usage: tests/volumes.sh [path to adzip], run from anywhere
+
+source "$(dirname "$0")/lib.sh"
+
+mkdir -p data/sub
+head -c 2000000 /dev/urandom > data/f1
+head -c 1500000 /dev/urandom > data/f2
+head -c 3000 /dev/urandom > data/sub/f3
+head -c 700 /dev/urandom > data/sub/f4
+
+"$ADZIP" -c --volumes=2 split.ad data > /dev/null
+mkdir extract
+(cd extract && "$ADZIP" -x ../split.ad x > /dev/null 2> ../extract.log)
+status=$?
+if [ "$status" -ne 0 ] || ! diff -r data extract/data > /dev/null; then
+    fail "the volumes did not extract to what was archived (exit $status): $(cat extract.log)"
+fi
+
+# Both volumes hold files, cut the one with the biggest file in it short
+volume=$(ls -S split.ad.[0-9]* | head -n 1)
+truncate -s 1000 "$volume"
+
+mkdir cut
+(cd cut && "$ADZIP" -x ../split.ad x > /dev/null 2> ../cut.log)
+status=$?
+if [ "$status" -eq 0 ]; then
+    fail "extracting from a truncated volume exited with 0"
+fi
+if ! grep -q "missing data" cut.log || ! grep -q "Extraction incomplete" cut.log; then
+    fail "extracting from a truncated volume did not report the missing data: $(cat cut.log)"
+fi
+
+if "$ADZIP" -e split.ad - > /dev/null 2> export.log; then
+    fail "exporting from a truncated volume exited with 0"
+fi
+
+finish